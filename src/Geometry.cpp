@@ -6,7 +6,6 @@
 
 Vec2::Vec2() { x = 0; y = 0; }
 Vec2::Vec2(double _x, double _y) { x = _x; y = _y; }
-Vec2::Vec2(const Vec2 &v) { x = v.x; y = v.y; }
 Vec2::Vec2(const Vec3 &v) { x = v.x; y = v.y; }
 	
 double Vec2::magnitude() { return sqrt(x*x + y*y); }
@@ -32,7 +31,6 @@ double cross(const Vec2& a, const Vec2& b) { return a.x*b.y - a.y*b.x; }
 
 Point2::Point2() { x = 0; y = 0; }
 Point2::Point2(double _x, double _y) { x = _x; y = _y; }
-Point2::Point2(const Point2& p) { x = p.x; y = p.y; }
 Point2::Point2(const Point3& p) { x = p.x; y = p.y; }
 
 Point2 operator+(const Point2& p, const Vec2& v) { return Point2(p.x+v.x, p.y+v.y); }
@@ -50,7 +48,6 @@ ostream& operator<<(ostream& s, const Point2& p)
 
 Vec3::Vec3() { x = 0; y = 0; }
 Vec3::Vec3(double _x, double _y, double _z) { x = _x; y = _y; z = _z; }
-Vec3::Vec3(const Vec3& v) { x = v.x; y = v.y; z = v.z; }
 
 double Vec3::magnitude() { return sqrt(x*x + y*y + z*z); }
 Vec3 Vec3::normalize() { return (*this)/magnitude(); }
@@ -75,7 +72,6 @@ Vec3 cross(const Vec3& a, const Vec3& b)
 
 Point3::Point3() { x = 0; y = 0; }
 Point3::Point3(double _x, double _y, double _z) { x = _x; y = _y; z = _z; }
-Point3::Point3(const Point3& p) { x = p.x; y = p.y; z = p.z; }
 
 Point3 operator+(const Point3& p, const Vec3& v) { return Point3(p.x+v.x, p.y+v.y, p.z+v.z); }
 Point3 operator+(const Vec3& v, const Point3& p) { return p+v; }
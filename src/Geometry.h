@@ -22,7 +22,6 @@ struct Vec2
 	
 	Vec2();
 	Vec2(double, double);
-	Vec2(const Vec2&);
 	Vec2(const Vec3&);
 	
 	double magnitude();
@@ -49,7 +48,6 @@ struct Point2
 	
 	Point2();
 	Point2(double, double);
-	Point2(const Point2&);
 	Point2(const Point3&);
 };
 
@@ -68,7 +66,6 @@ struct Vec3
 	
 	Vec3();
 	Vec3(double, double, double);
-	Vec3(const Vec3&);
 	
 	double magnitude();
 	Vec3 normalize();
@@ -93,7 +90,6 @@ struct Point3
 	
 	Point3();
 	Point3(double, double, double);
-	Point3(const Point3&);
 };
 
 Point3 operator+(const Point3&, const Vec3&);
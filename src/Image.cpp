@@ -2,11 +2,14 @@
 
 #include <math.h>
 #include <inttypes.h>
+#include <stdlib.h>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
 
 
 
 Color::Color() { r = 0; g = 0; b = 0; }
-Color::Color(const Color& c) { r = c.r; g = c.g; b = c.b; }
 Color::Color(double _r, double _g, double _b) { r = _r; g = _g; b = _b; }
 
 Color Color::clamp() { return Color(r>1?1:r<0?0:r, g>1?1:g<0?0:g, b>1?1:b<0?0:b); }
@@ -21,80 +24,559 @@ Color operator*(double f, const Color& a) { return a*f; }
 
 
 
-Image::Image(int _width, int _height)
+Image::Image(int _width, int _height) : Array2D<Color>(_width, _height) {}
+
+// Converts a row of colors to 8-bit BGRA, the order TGA stores them in
+static void row_to_BGRA(const Color *row, int width, uint8_t *out)
+{
+	for (int x=0; x<width; x++)
+	{
+		Color c = Color(row[x]).clamp();
+		out[4*x+0] = (uint8_t)(c.b*255);
+		out[4*x+1] = (uint8_t)(c.g*255);
+		out[4*x+2] = (uint8_t)(c.r*255);
+		out[4*x+3] = 255;
+	}
+}
+
+// Run-length encodes a row of pixels (32-bit colors or 8-bit indices) as TGA packets. A packet is
+// a count byte followed by either one pixel repeated (high bit set) or that many literal pixels,
+// at most 128 either way. Packets don't cross rows, as the format recommends.
+template<typename Pixel> static void rle_encode_row(const Pixel *p, int width, vector<uint8_t>& out)
 {
-	width = _width;
-	height = _height;
-	pixels = new Color[width*height];
+	const uint8_t *pixels = (const uint8_t*)p;
+	const int size = sizeof(Pixel);
+	int x = 0;
+	while (x < width)
+	{
+		int run = 1;
+		while (x+run < width && run < 128 && p[x+run] == p[x]) run++;
+		
+		if (run > 1)
+		{
+			out.push_back(0x80 | (run-1));
+			out.insert(out.end(), pixels + size*x, pixels + size*(x+1));
+			x += run;
+			continue;
+		}
+		
+		// Gather literals up to the start of the next run
+		int count = 1;
+		while (x+count < width && count < 128 &&
+			!(x+count+1 < width && p[x+count+1] == p[x+count])) count++;
+		out.push_back(count-1);
+		out.insert(out.end(), pixels + size*x, pixels + size*(x+count));
+		x += count;
+	}
 }
 
-Image::Image(Image& src)
+// A TGA header, for a true-color image (with colormapped false) or one with a color map of 24-bit
+// entries
+static void write_TGA_header(ostream &s, bool rle, bool colormapped, int colormap_length, int width, int height)
 {
-	width = src.width;
-	height = src.height;
-	pixels = new Color[width*height];
+	uint8_t id_length = 0; // No id field
+	s.write((const char*)&id_length, 1);
+	
+	uint8_t colormap_type = colormapped ? 1 : 0;
+	s.write((const char*)&colormap_type, 1);
+	
+	// Color-mapped or true-color image, run-length encoded or not
+	uint8_t image_type = (colormapped ? 1 : 2) + (rle ? 8 : 0);
+	s.write((const char*)&image_type, 1);
+	
+	uint16_t colormap_first = 0, _colormap_length = colormapped ? colormap_length : 0;
+	uint8_t colormap_bpp = colormapped ? 24 : 0;
+	s.write((const char*)&colormap_first, 2);
+	s.write((const char*)&_colormap_length, 2);
+	s.write((const char*)&colormap_bpp, 1);
 	
-	for (int x=0; x<width; x++) for (int y=0; y<height; y++)
-		pixels[x+y*width] = src.pixels[x+y*width];
+	uint16_t xorigin=0, yorigin=0, _width=width, _height=height;
+	uint8_t bpp = colormapped ? 8 : 32;
+	uint8_t descriptor = colormapped ? 0x00 : 0x08; // 8 bits of alpha per true-color pixel
+	s.write((const char*)&xorigin, 2);
+	s.write((const char*)&yorigin, 2);
+	s.write((const char*)&_width, 2);
+	s.write((const char*)&_height, 2);
+	s.write((const char*)&bpp, 1);
+	s.write((const char*)&descriptor, 1);
+}
+
+// Writes a row of pixels, run-length encoding it with rle
+template<typename Pixel> static void write_TGA_row(
+	ostream &s,
+	const Pixel *pixels,
+	int width,
+	bool rle,
+	vector<uint8_t>& packets)
+{
+	if (rle)
+	{
+		packets.clear();
+		rle_encode_row(pixels, width, packets);
+		s.write((const char*)&packets[0], packets.size());
+	}
+	else
+	{
+		s.write((const char*)pixels, width*sizeof(Pixel));
+	}
 }
 
-Image::~Image()
+// Writes the image as a 32-bit TGA, bottom row first. Rows are converted (and compressed, with
+// rle) a whole row at a time and written in one go.
+void Image::write_TGA(ostream &s, bool rle)
 {
-	delete[] pixels;
+	write_TGA_header(s, rle, false, 0, width, height);
+	
+	vector<uint32_t> pixels(width);
+	vector<uint8_t> packets;
+	for (int y=0; y<height; y++)
+	{
+		row_to_BGRA(row(y), width, (uint8_t*)&pixels[0]);
+		write_TGA_row(s, &pixels[0], width, rle, packets);
+	}
 }
+
+
+
+// A zlib stream (RFC 1950) holding data compressed with deflate (RFC 1951). Matches are found
+// with a hash chain over the last 32K, and coded with the fixed Huffman codes, which is simple
+// and does well on images with long runs of the same color. Data that doesn't compress is
+// stored instead.
+class ZlibWriter
+{
+public:
+	static vector<uint8_t> compress(const vector<uint8_t>& data)
+	{
+		ZlibWriter z;
+		z.out.push_back(0x78); // deflate with a 32K window
+		z.out.push_back(0x01); // no dictionary, fastest compression level
+		
+		z.deflate(data);
+		if (z.out.size() > 2 + data.size() + 5*(data.size()/65535 + 1))
+		{
+			z.out.resize(2);
+			z.store(data);
+		}
+		
+		uint32_t adler = adler32(data);
+		for (int i=3; i>=0; i--) z.out.push_back(adler >> 8*i);
+		return z.out;
+	}
+	
+private:
+	static constexpr int window = 32768;
+	static constexpr int min_match = 3, max_match = 258;
+	static constexpr int max_chain = 64;
+	static constexpr int hash_bits = 15;
+	
+	vector<uint8_t> out;
+	uint32_t bit_buffer;
+	int bit_count;
+	
+	ZlibWriter() : bit_buffer(0), bit_count(0) {}
+	
+	static uint32_t adler32(const vector<uint8_t>& data)
+	{
+		uint32_t a = 1, b = 0;
+		size_t i = 0;
+		while (i < data.size())
+		{
+			// Sums can go this long without overflowing before they're reduced
+			size_t end = min(data.size(), i + 5552);
+			for (; i<end; i++) { a += data[i]; b += a; }
+			a %= 65521;
+			b %= 65521;
+		}
+		return (b << 16) | a;
+	}
+	
+	// Deflate packs bits starting from the least significant
+	void put_bits(uint32_t bits, int count)
+	{
+		bit_buffer |= bits << bit_count;
+		bit_count += count;
+		while (bit_count >= 8)
+		{
+			out.push_back(bit_buffer);
+			bit_buffer >>= 8;
+			bit_count -= 8;
+		}
+	}
+	
+	void flush_bits()
+	{
+		if (bit_count > 0) out.push_back(bit_buffer);
+		bit_buffer = 0;
+		bit_count = 0;
+	}
+	
+	// Huffman codes go most significant bit first, so they're reversed into the bit stream
+	void put_code(uint32_t code, int length)
+	{
+		uint32_t reversed = 0;
+		for (int i=0; i<length; i++) reversed |= ((code >> i) & 1) << (length-1-i);
+		put_bits(reversed, length);
+	}
+	
+	void put_literal(int value)
+	{
+		if (value < 144) put_code(0x30 + value, 8);
+		else if (value < 256) put_code(0x190 + value - 144, 9);
+		else if (value < 280) put_code(value - 256, 7);
+		else put_code(0xc0 + value - 280, 8);
+	}
+	
+	void put_match(int length, int distance)
+	{
+		static const int length_base[29] = {
+			3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+			35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+		static const int length_extra[29] = {
+			0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+			3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+		static const int distance_base[30] = {
+			1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+			257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+		static const int distance_extra[30] = {
+			0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+			7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+		
+		int l = 28;
+		while (length_base[l] > length) l--;
+		put_literal(257 + l);
+		put_bits(length - length_base[l], length_extra[l]);
+		
+		int d = 29;
+		while (distance_base[d] > distance) d--;
+		put_code(d, 5);
+		put_bits(distance - distance_base[d], distance_extra[d]);
+	}
+	
+	static uint32_t hash(const uint8_t *p)
+	{
+		return ((p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u) >> (32 - hash_bits);
+	}
 	
-Color& Image::operator()(int x, int y)
+	// One final block with the fixed codes
+	void deflate(const vector<uint8_t>& data)
+	{
+		put_bits(1, 1); // last block
+		put_bits(1, 2); // fixed Huffman codes
+		
+		int size = data.size();
+		const uint8_t *d = size ? &data[0] : 0;
+		vector<int> head(1 << hash_bits, -1), prev(window, -1);
+		
+		int i = 0;
+		while (i < size)
+		{
+			int best_length = 0, best_distance = 0;
+			
+			if (i + min_match <= size)
+			{
+				uint32_t h = hash(d + i);
+				int limit = min(max_match, size - i);
+				int candidate = head[h];
+				for (int chain=0; candidate >= 0 && i - candidate <= window && chain < max_chain;
+					chain++)
+				{
+					int length = 0;
+					while (length < limit && d[candidate+length] == d[i+length]) length++;
+					if (length > best_length)
+					{
+						best_length = length;
+						best_distance = i - candidate;
+						if (length == limit) break;
+					}
+					candidate = prev[candidate % window];
+				}
+			}
+			
+			int advance = 1;
+			if (best_length >= min_match)
+			{
+				put_match(best_length, best_distance);
+				advance = best_length;
+			}
+			else
+			{
+				put_literal(d[i]);
+			}
+			
+			// Every position passed over goes into the hash chains, so later matches can find it
+			for (int end = i + advance; i < end; i++)
+			{
+				if (i + min_match > size) continue;
+				uint32_t h = hash(d + i);
+				prev[i % window] = head[h];
+				head[h] = i;
+			}
+		}
+		
+		put_literal(256); // end of block
+		flush_bits();
+	}
+	
+	// Stored blocks, of at most 64K each
+	void store(const vector<uint8_t>& data)
+	{
+		size_t pos = 0;
+		do
+		{
+			size_t length = min<size_t>(65535, data.size() - pos);
+			bool last = pos + length == data.size();
+			out.push_back(last ? 1 : 0);
+			out.push_back(length);
+			out.push_back(length >> 8);
+			out.push_back(~length);
+			out.push_back(~length >> 8);
+			out.insert(out.end(), data.begin() + pos, data.begin() + pos + length);
+			pos += length;
+		}
+		while (pos < data.size());
+	}
+};
+
+// The CRC of each byte value, for crc32()
+struct CRCTable
+{
+	uint32_t entries[256];
+	
+	CRCTable()
+	{
+		for (uint32_t n=0; n<256; n++)
+		{
+			uint32_t c = n;
+			for (int k=0; k<8; k++) c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			entries[n] = c;
+		}
+	}
+};
+
+static uint32_t crc32(const uint8_t *data, size_t length, uint32_t crc = 0)
 {
-	return pixels[x+y*width];
+	// Made on first use, which is thread-safe for a local static, as PNGs may be written from
+	// several threads at once
+	static const CRCTable table;
+	
+	crc = ~crc;
+	for (size_t i=0; i<length; i++) crc = table.entries[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static void put_uint32(vector<uint8_t>& out, uint32_t v)
+{
+	for (int i=3; i>=0; i--) out.push_back(v >> 8*i);
+}
+
+// A PNG chunk is its length, type, data, and a CRC of the type and data
+static void write_PNG_chunk(ostream &s, const char *type, const vector<uint8_t>& data)
+{
+	vector<uint8_t> chunk;
+	put_uint32(chunk, data.size());
+	chunk.insert(chunk.end(), type, type + 4);
+	chunk.insert(chunk.end(), data.begin(), data.end());
+	put_uint32(chunk, crc32(&chunk[4], chunk.size() - 4));
+	s.write((const char*)&chunk[0], chunk.size());
 }
 
-Image& Image::operator=(Image& src)
+static void write_PNG_file(
+	ostream &s,
+	int width, int height,
+	const vector<uint32_t> *palette,
+	const vector<uint8_t>& filtered);
+
+// Writes the image as a PNG. Images with at most 256 colors, which sprite sheets almost always
+// are, are written with a palette and a byte per pixel; others as 24-bit color, with each row
+// filtered by whichever PNG filter leaves it smallest. Our rows go bottom up, and PNG's top down.
+void Image::write_PNG(ostream &s)
 {
-	delete[] pixels;
+	// Convert to 8-bit color, and try to build a palette along the way
+	vector<uint8_t> rgb(3*width*height);
+	vector<uint8_t> indices(width*height);
+	vector<uint32_t> palette;
+	unordered_map<uint32_t, uint8_t> palette_index;
+	bool paletted = true;
 	
-	width = src.width;
-	height = src.height;
-	pixels = new Color[width*height];
+	vector<uint8_t> bgra(4*width);
+	for (int y=0; y<height; y++)
+	{
+		row_to_BGRA(row(height-1-y), width, &bgra[0]);
+		for (int x=0; x<width; x++)
+		{
+			uint8_t *p = &rgb[3*(x+y*width)];
+			p[0] = bgra[4*x+2];
+			p[1] = bgra[4*x+1];
+			p[2] = bgra[4*x+0];
+			if (!paletted) continue;
+			
+			uint32_t color = p[0] << 16 | p[1] << 8 | p[2];
+			unordered_map<uint32_t, uint8_t>::iterator it = palette_index.find(color);
+			if (it != palette_index.end())
+			{
+				indices[x+y*width] = it->second;
+			}
+			else if (palette.size() < 256)
+			{
+				indices[x+y*width] = palette.size();
+				palette_index[color] = palette.size();
+				palette.push_back(color);
+			}
+			else
+			{
+				paletted = false;
+			}
+		}
+	}
 	
-	for (int x=0; x<width; x++) for (int y=0; y<height; y++)
-		pixels[x+y*width] = src.pixels[x+y*width];
+	// Lay out the rows, each with the byte saying how it's filtered
+	vector<uint8_t> filtered;
+	if (paletted)
+	{
+		// Filtering rarely helps paletted images, since neighboring indices aren't related
+		filtered.reserve((width+1)*height);
+		for (int y=0; y<height; y++)
+		{
+			filtered.push_back(0);
+			filtered.insert(filtered.end(), &indices[y*width], &indices[y*width] + width);
+		}
+	}
+	else
+	{
+		int stride = 3*width;
+		vector<uint8_t> zero(stride, 0), candidate(stride), best(stride);
+		filtered.reserve((stride+1)*height);
+		for (int y=0; y<height; y++)
+		{
+			const uint8_t *cur = &rgb[y*stride];
+			const uint8_t *up = y > 0 ? &rgb[(y-1)*stride] : &zero[0];
+			
+			long best_cost = -1;
+			int best_filter = 0;
+			for (int filter=0; filter<5; filter++)
+			{
+				long cost = 0;
+				for (int i=0; i<stride; i++)
+				{
+					int a = i >= 3 ? cur[i-3] : 0, b = up[i], c = i >= 3 ? up[i-3] : 0;
+					int predicted = 0;
+					if (filter == 1) predicted = a;
+					else if (filter == 2) predicted = b;
+					else if (filter == 3) predicted = (a + b) / 2;
+					else if (filter == 4)
+					{
+						// Paeth: whichever neighbor is closest to a + b - c
+						int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2*c);
+						predicted = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+					}
+					candidate[i] = cur[i] - predicted;
+					cost += abs((int8_t)candidate[i]);
+				}
+				if (best_cost < 0 || cost < best_cost)
+				{
+					best_cost = cost;
+					best_filter = filter;
+					best.swap(candidate);
+				}
+			}
+			
+			filtered.push_back(best_filter);
+			filtered.insert(filtered.end(), best.begin(), best.end());
+		}
+	}
 	
-	return *this;
+	write_PNG_file(s, width, height, paletted ? &palette : NULL, filtered);
 }
 
-void Image::write_TGA(ofstream &s)
+// Writes a PNG holding filtered rows of 8-bit samples, which are palette indices if there's a
+// palette (of 0xRRGGBB colors) and RGB if not
+static void write_PNG_file(
+	ostream &s,
+	int width, int height,
+	const vector<uint32_t> *palette,
+	const vector<uint8_t>& filtered)
 {
-	uint8_t id_length = 0; // No id field
-	s.write((const char*)&id_length, 1);
+	bool paletted = palette;
+	const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+	s.write((const char*)signature, 8);
 	
-	uint8_t colormap_type = 0; // No color map
-	s.write((const char*)&colormap_type, 1);
+	vector<uint8_t> header;
+	put_uint32(header, width);
+	put_uint32(header, height);
+	header.push_back(8); // bits per sample
+	header.push_back(paletted ? 3 : 2); // color type: palette, or RGB
+	header.push_back(0); // deflate
+	header.push_back(0); // adaptive filtering
+	header.push_back(0); // not interlaced
+	write_PNG_chunk(s, "IHDR", header);
 	
-	uint8_t image_type = 2; // Uncompressed, true-color image
-	s.write((const char*)&image_type, 1);
+	if (paletted)
+	{
+		vector<uint8_t> entries;
+		for (unsigned int i=0; i<palette->size(); i++)
+		{
+			entries.push_back((*palette)[i] >> 16);
+			entries.push_back((*palette)[i] >> 8);
+			entries.push_back((*palette)[i]);
+		}
+		write_PNG_chunk(s, "PLTE", entries);
+	}
 	
-	uint8_t color_map_info[5] = {0, 0, 0, 0, 24}; // Unused
-	s.write((const char*)&color_map_info, 5);
+	write_PNG_chunk(s, "IDAT", ZlibWriter::compress(filtered));
+	write_PNG_chunk(s, "IEND", vector<uint8_t>());
+}
+
+
+
+IndexedImage::IndexedImage(int _width, int _height) : Array2D<uint8_t>(_width, _height) {}
+
+// The palette as 8-bit colors, packed as 0xRRGGBB. Neither format can hold an empty palette, or
+// one too big for a byte to index.
+static vector<uint32_t> palette_RGB(const vector<Color>& palette)
+{
+	if (palette.empty() || palette.size() > 256) throw logic_error("an indexed image needs 1 to 256 palette entries");
 	
-	uint16_t xorigin=0, yorigin=0, _width=width, _height=height;
-	uint8_t bpp = 32, descriptor = 0x00;
-	s.write((const char*)&xorigin, 2);
-	s.write((const char*)&yorigin, 2);
-	s.write((const char*)&_width, 2);
-	s.write((const char*)&_height, 2);
-	s.write((const char*)&bpp, 1);
-	s.write((const char*)&descriptor, 1);
+	vector<uint32_t> colors(palette.size());
+	for (unsigned int i=0; i<palette.size(); i++)
+	{
+		uint8_t bgra[4];
+		row_to_BGRA(&palette[i], 1, bgra);
+		colors[i] = bgra[2] << 16 | bgra[1] << 8 | bgra[0];
+	}
+	return colors;
+}
+
+// Writes the image as a color-mapped TGA, with 24-bit palette entries and a byte per pixel
+void IndexedImage::write_TGA(ostream &s, bool rle)
+{
+	vector<uint32_t> colors = palette_RGB(palette);
+	write_TGA_header(s, rle, true, colors.size(), width, height);
 	
-	for (int y=0; y<height; y++) for (int x=0; x<width; x++)
+	vector<uint8_t> entries;
+	for (unsigned int i=0; i<colors.size(); i++)
 	{
-		Color c = (*this)(x,y).clamp();
-		uint8_t pixel[4] = {c.b*255, c.g*255, c.r*255, 255};
-		s.write((const char*)&pixel, 4);
+		entries.push_back(colors[i]);
+		entries.push_back(colors[i] >> 8);
+		entries.push_back(colors[i] >> 16);
 	}
+	s.write((const char*)&entries[0], entries.size());
+	
+	vector<uint8_t> packets;
+	for (int y=0; y<height; y++) write_TGA_row(s, row(y), width, rle, packets);
 }
 
-void Image::clear(const Color &c)
+// Writes the image as a PNG with its palette, top row first
+void IndexedImage::write_PNG(ostream &s)
 {
-	for (int x=0; x<width; x++) for (int y=0; y<height; y++)
-		(*this)(x,y) = c;
+	vector<uint32_t> colors = palette_RGB(palette);
+	
+	vector<uint8_t> filtered;
+	filtered.reserve((width+1)*height);
+	for (int y=height-1; y>=0; y--)
+	{
+		filtered.push_back(0);
+		filtered.insert(filtered.end(), row(y), row(y) + width);
+	}
+	
+	write_PNG_file(s, width, height, &colors, filtered);
 }
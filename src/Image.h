@@ -1,4 +1,8 @@
+#include <algorithm>
 #include <fstream>
+#include <memory>
+#include <new>
+#include <vector>
 
 using namespace std;
 
@@ -14,7 +18,6 @@ struct Color
 	double r,g,b;
 	
 	Color();
-	Color(const Color&);
 	Color(double, double, double);
 	
 	Color clamp();
@@ -29,85 +32,182 @@ Color operator*(double, const Color&);
 
 
 
-struct Image
-{
-	int width, height;
-	Color *pixels;
-	
-	Image(int, int);
-	Image(Image&);
-	~Image();
-	
-	Color &operator()(int, int);
-	Image &operator=(Image&);
-	
-	void write_TGA(ofstream& outstream);
-	void clear(const Color&);
-};
-
-
-
+// A 2D array, stored a row at a time. The storage is aligned to a cache line, so rows of SIMD
+// types can be loaded without straddling one at the start. Arrays can be moved cheaply, and the
+// bulk operations work a row at a time, so for simple element types they come down to memset and
+// memcpy.
 template<typename T> struct Array2D
 {
 	int width, height;
 	T *values;
+	int capacity;
+	
+	typedef T Value;
+	static const size_t alignment = 64;
 	
 	Array2D(int, int);
-	Array2D(Array2D<T>&);
+	Array2D(const Array2D<T>&);
+	Array2D(Array2D<T>&&);
 	~Array2D();
 	
-	T &operator()(int, int);
-	Array2D<T> &operator=(Array2D<T>&);
-	void clear(const T&);
+	T &operator()(int x, int y) { return values[x+y*width]; }
+	const T &operator()(int x, int y) const { return values[x+y*width]; }
+	T *row(int y) { return values + y*width; }
+	const T *row(int y) const { return values + y*width; }
+	
+	Array2D<T> &operator=(const Array2D<T>&);
+	Array2D<T> &operator=(Array2D<T>&&);
+	
+	void fill(const T&);
+	void copy(const Array2D<T>&);
+	void blit(const Array2D<T>&, int sx, int sy, int w, int h, int dx, int dy);
+	void resize(int, int);
+	
+private:
+	static T *allocate(int);
+	static void deallocate(T*, int);
 };
 
+template<typename T> T *Array2D<T>::allocate(int count)
+{
+	if (count == 0) return 0;
+	T *p = (T*)::operator new(count*sizeof(T), align_val_t(alignment));
+	uninitialized_default_construct_n(p, count);
+	return p;
+}
+
+template<typename T> void Array2D<T>::deallocate(T *p, int count)
+{
+	if (!p) return;
+	destroy_n(p, count);
+	::operator delete(p, align_val_t(alignment));
+}
+
 template<typename T> Array2D<T>::Array2D(int _width, int _height)
 {
 	width = _width;
 	height = _height;
-	values = new T[width*height];
+	capacity = width*height;
+	values = allocate(capacity);
 }
 
-template<typename T> Array2D<T>::Array2D(Array2D<T>& src)
+template<typename T> Array2D<T>::Array2D(const Array2D<T>& src)
 {
 	width = src.width;
 	height = src.height;
-	values = new T[width*height];
+	capacity = width*height;
+	values = allocate(capacity);
+	std::copy(src.values, src.values + width*height, values);
+}
+
+template<typename T> Array2D<T>::Array2D(Array2D<T>&& src)
+{
+	width = src.width;
+	height = src.height;
+	capacity = src.capacity;
+	values = src.values;
 	
-	for (int x=0; x<width; x++) for (int y=0; y<height; y++)
-		values[x+y*width] = src.values[x+y*width];
+	src.width = src.height = src.capacity = 0;
+	src.values = 0;
 }
 
 template<typename T> Array2D<T>::~Array2D()
 {
-	delete[] values;
+	deallocate(values, capacity);
 }
-	
-template<typename T> T& Array2D<T>::operator()(int x, int y)
+
+template<typename T> Array2D<T>& Array2D<T>::operator=(const Array2D<T>& src)
 {
-	return values[x+y*width];
+	if (this != &src) copy(src);
+	return *this;
 }
 
-template<typename T> Array2D<T>& Array2D<T>::operator=(Array2D<T>& src)
+template<typename T> Array2D<T>& Array2D<T>::operator=(Array2D<T>&& src)
 {
-	delete[] values;
+	if (this == &src) return *this;
+	deallocate(values, capacity);
 	
 	width = src.width;
 	height = src.height;
-	values = new T[width*height];
-	
-	for (int x=0; x<width; x++) for (int y=0; y<height; y++)
-		values[x+y*width] = src.values[x+y*width];
+	capacity = src.capacity;
+	values = src.values;
 	
+	src.width = src.height = src.capacity = 0;
+	src.values = 0;
 	return *this;
 }
 
-template<typename T> void Array2D<T>::clear(const T& val)
+template<typename T> void Array2D<T>::fill(const T& val)
 {
-	for (int x=0; x<width; x++) for (int y=0; y<height; y++)
-		(*this)(x,y) = val;
+	std::fill(values, values + width*height, val);
+}
+
+// Makes this array a copy of src, reusing the storage if it's big enough
+template<typename T> void Array2D<T>::copy(const Array2D<T>& src)
+{
+	resize(src.width, src.height);
+	std::copy(src.values, src.values + width*height, values);
+}
+
+// Copies the w by h rectangle at (sx,sy) in src to (dx,dy) in this array. The rectangle is
+// clipped to both arrays.
+template<typename T> void Array2D<T>::blit(
+	const Array2D<T>& src,
+	int sx, int sy,
+	int w, int h,
+	int dx, int dy)
+{
+	if (sx < 0) { w += sx; dx -= sx; sx = 0; }
+	if (sy < 0) { h += sy; dy -= sy; sy = 0; }
+	if (dx < 0) { w += dx; sx -= dx; dx = 0; }
+	if (dy < 0) { h += dy; sy -= dy; dy = 0; }
+	w = min(w, min(src.width - sx, width - dx));
+	h = min(h, min(src.height - sy, height - dy));
+	if (w <= 0 || h <= 0) return;
+	
+	for (int y=0; y<h; y++)
+	{
+		const T *in = src.row(sy+y) + sx;
+		std::copy(in, in + w, row(dy+y) + dx);
+	}
+}
+
+// Changes the dimensions of the array. The contents are lost, but the storage is only reallocated
+// if it has to grow.
+template<typename T> void Array2D<T>::resize(int _width, int _height)
+{
+	if (_width*_height > capacity)
+	{
+		deallocate(values, capacity);
+		capacity = _width*_height;
+		values = allocate(capacity);
+	}
+	width = _width;
+	height = _height;
 }
 
 
 
-#endif
\ No newline at end of file
+// An image is an array of colors, which can be written out to a file
+struct Image : Array2D<Color>
+{
+	Image(int, int);
+	
+	void write_TGA(ostream& outstream, bool rle = false);
+	void write_PNG(ostream& outstream);
+};
+
+// An image whose pixels are indices into a palette of at most 256 colors
+struct IndexedImage : Array2D<uint8_t>
+{
+	vector<Color> palette;
+	
+	IndexedImage(int, int);
+	
+	void write_TGA(ostream& outstream, bool rle = false);
+	void write_PNG(ostream& outstream);
+};
+
+
+
+#endif
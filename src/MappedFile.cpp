@@ -0,0 +1,63 @@
+#include "MappedFile.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+
+MappedFile::MappedFile(const string& path)
+{
+	data = NULL;
+	size = 0;
+	opened = false;
+	
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) return;
+	
+	struct stat info;
+	if (fstat(fd, &info) < 0)
+	{
+		close(fd);
+		return;
+	}
+	size = info.st_size;
+	
+	// Empty files can't be mapped, but there's nothing to read from them anyway
+	if (size > 0)
+	{
+		void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapping == MAP_FAILED)
+		{
+			close(fd);
+			size = 0;
+			return;
+		}
+		madvise(mapping, size, MADV_SEQUENTIAL);
+		data = (const char*)mapping;
+	}
+	
+	close(fd);
+	opened = true;
+}
+
+MappedFile::~MappedFile()
+{
+	if (data) munmap((void*)data, size);
+}
+
+bool MappedFile::is_open() const
+{
+	return opened;
+}
+
+const char *MappedFile::begin() const
+{
+	return data;
+}
+
+const char *MappedFile::end() const
+{
+	return data + size;
+}
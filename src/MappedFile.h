@@ -0,0 +1,37 @@
+#include <string>
+#include <stddef.h>
+
+using namespace std;
+
+
+
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+
+
+// A read-only view of a whole file, memory-mapped so that it can be read in place without copying
+// it into a buffer first. Like an ifstream, check is_open() before reading.
+struct MappedFile
+{
+	const char *data;
+	size_t size;
+	
+	MappedFile(const string& path);
+	~MappedFile();
+	
+	bool is_open() const;
+	
+	const char *begin() const;
+	const char *end() const;
+	
+private:
+	bool opened;
+	
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+};
+
+
+
+#endif
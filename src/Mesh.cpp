@@ -1,9 +1,21 @@
 #include "Mesh.h"
 
-#include <sstream>
+#include "MappedFile.h"
+
 #include <vector>
+#include <algorithm>
+#include <unordered_map>
 #include <iostream>
+#include <iterator>
+#include <mutex>
 #include <stdexcept>
+#include <type_traits>
+#include <charconv>
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 
 
@@ -31,289 +43,871 @@ Material::Material(const Color& a, const Color& d, const Color& s, double sh)
 	shininess = sh;
 }
 
-map<string, Material*> Material::from_mtlfile(ifstream &file_s)
+// Reads whitespace-separated fields from one line of a file held in memory, in place.
+struct LineReader
+{
+	const char *p, *end;
+	
+	LineReader(const char *_p, const char *_end) : p(_p), end(_end)
+	{
+	}
+	
+	void skip_space()
+	{
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\v' || *p == '\f')) p++;
+	}
+	
+	// Reads the next field as a word, without copying it. Returns false if there are none left.
+	bool read_word(const char *&word, const char *&word_end)
+	{
+		skip_space();
+		if (p >= end) return false;
+		word = p;
+		while (p < end && !(*p == ' ' || *p == '\t' || *p == '\r' || *p == '\v' || *p == '\f')) p++;
+		word_end = p;
+		return true;
+	}
+	
+	bool read_word(string &word)
+	{
+		const char *word_start, *word_end;
+		if (!read_word(word_start, word_end)) return false;
+		word.assign(word_start, word_end);
+		return true;
+	}
+	
+	bool read(double &value)
+	{
+		skip_space();
+		return parse_number(p, end, value);
+	}
+	
+	// Parses a number at the start of [p, end), and advances p past it if that succeeds
+	template<typename T> static bool parse_number(const char *&p, const char *end, T &value)
+	{
+		const char *start = p;
+		if (start < end && *start == '+') start++;
+		from_chars_result result = from_chars(start, end, value);
+		if (result.ec != errc()) return false;
+		p = result.ptr;
+		return true;
+	}
+};
+
+bool word_is(const char *word, const char *word_end, const char *keyword)
+{
+	size_t length = strlen(keyword);
+	return (size_t)(word_end - word) == length && memcmp(word, keyword, length) == 0;
+}
+
+// Calls parse_line(line_start, line_end) for every line of [begin, end)
+template<typename LineParser> void for_each_line(const char *begin, const char *end, LineParser& parse_line)
+{
+	const char *line = begin;
+	while (line < end)
+	{
+		const char *line_end = (const char*)memchr(line, '\n', end - line);
+		if (!line_end) line_end = end;
+		parse_line(line, line_end);
+		line = line_end + 1;
+	}
+}
+
+string read_stream(ifstream &file_s)
+{
+	return string(istreambuf_iterator<char>(file_s), istreambuf_iterator<char>());
+}
+
+
+
+struct MtlParser
 {
 	Color amb, diff, spec;
 	double sh;
 	string name;
-	bool in_mtl = false;
+	bool in_mtl;
 	
 	map<string, Material*> mtls;
 	
-	while (true)
+	MtlParser()
+	{
+		sh = 0;
+		in_mtl = false;
+	}
+	
+	void read_color(LineReader &line, Color &c, const char *error)
 	{
-		string line;
-		getline(file_s, line);
-		if (file_s.fail()) break;
-		stringstream line_ss(line);
+		double rgb[3];
+		if (!(line.read(rgb[0]) && line.read(rgb[1]) && line.read(rgb[2])))
+			throw logic_error(error);
+		c = Color(rgb[0], rgb[1], rgb[2]);
+	}
+	
+	void operator()(const char *line_start, const char *line_end)
+	{
+		LineReader line(line_start, line_end);
 		
-		string keyword;
-		line_ss >> keyword;
-		if (line_ss.fail()) continue;
+		const char *keyword, *keyword_end;
+		if (!line.read_word(keyword, keyword_end)) return;
 		
-		if (keyword == "newmtl")
+		if (word_is(keyword, keyword_end, "newmtl"))
 		{
-			if (in_mtl)
-			{
-				mtls[name] = new Material(amb, diff, spec, sh);
-				in_mtl = false;
-			}
+			finish();
 			
 			amb = Color(0.5, 0.5, 0.5);
 			diff = Color(0.5, 0.5, 0.5);
 			spec = Color(0, 0, 0);
 			sh = 100.0;
 			
-			line_ss >> name;
-			if (line_ss.fail())
+			if (!line.read_word(name))
 				throw logic_error("parse error: newmtl is missing name");
 			
 			in_mtl = true;
 		}
-		else if (keyword == "Ka")
+		else if (word_is(keyword, keyword_end, "Ka"))
+			read_color(line, amb, "parse error: Ka has bad fields");
+		else if (word_is(keyword, keyword_end, "Kd"))
+			read_color(line, diff, "parse error: Kd has bad fields");
+		else if (word_is(keyword, keyword_end, "Ks"))
+			read_color(line, spec, "parse error: Ks has bad fields");
+		else if (word_is(keyword, keyword_end, "Ns"))
 		{
-			double c[3];
-			line_ss >> c[0] >> c[1] >> c[2];
-			if (line_ss.fail())
-				throw logic_error("parse error: Ka has bad fields");
-			amb = Color(c[0], c[1], c[2]);
-		}
-		else if (keyword == "Kd")
-		{
-			double c[3];
-			line_ss >> c[0] >> c[1] >> c[2];
-			if (line_ss.fail())
-				throw logic_error("parse error: Kd has bad fields");
-			diff = Color(c[0], c[1], c[2]);
-		}
-		else if (keyword == "Ks")
-		{
-			double c[3];
-			line_ss >> c[0] >> c[1] >> c[2];
-			if (line_ss.fail())
-				throw logic_error("parse error: Ks has bad fields");
-			spec = Color(c[0], c[1], c[2]);
-		}
-		else if (keyword == "Ns")
-		{
-			line_ss >> sh;
-			if (line_ss.fail())
+			if (!line.read(sh))
 				throw logic_error("parse error: Ns has bad field");
 		}
 	}
 	
-	if (in_mtl)
+	void finish()
 	{
-		mtls[name] = new Material(amb, diff, spec, sh);
-		in_mtl = false;
+		if (in_mtl)
+		{
+			mtls[name] = new Material(amb, diff, spec, sh);
+			in_mtl = false;
+		}
 	}
-	
-	return mtls;
-}
-
+};
 
-
-Vertex::Vertex()
+map<string, Material*> Material::from_mtlfile(const char *begin, const char *end)
 {
+	MtlParser parser;
+	try
+	{
+		for_each_line(begin, end, parser);
+		parser.finish();
+	}
+	catch (...)
+	{
+		// Nobody else has the materials read so far
+		for (map<string, Material*>::iterator it = parser.mtls.begin(); it != parser.mtls.end(); it++)
+			delete (*it).second;
+		throw;
+	}
+	return parser.mtls;
 }
 
-Vertex::Vertex(const Point3& _p, const Vec3& _n, const Point2& _t)
+map<string, Material*> Material::from_mtlfile(ifstream &file_s)
 {
-	point = _p;
-	normal = _n;
-	texcoord = _t;
+	string text = read_stream(file_s);
+	return Material::from_mtlfile(text.data(), text.data() + text.size());
 }
 
-
-
-Face::Face(const Vertex& v1, const Vertex& v2, const Vertex& v3, const Material* m)
+map<string, Material*> Material::from_mtlfile(const string& path)
 {
-	vertices[0] = v1;
-	vertices[1] = v2;
-	vertices[2] = v3;
-	material = m;
+	MappedFile file(path);
+	if (!file.is_open()) throw logic_error("failed to open mtl file "+path);
+	return Material::from_mtlfile(file.begin(), file.end());
 }
 
-void Face::autocompute_normals()
-{
-	Vec3 n = cross(
-		vertices[0].point - vertices[1].point,
-		vertices[0].point - vertices[2].point)
-		.normalize();
-	vertices[0].normal = n;
-	vertices[1].normal = n;
-	vertices[2].normal = n;
-}
 
 
+// A vertex of an .obj face, as (zero-based) indices into the point, texcoord and normal lists.
+// Omitted attributes are -1.
+struct ObjVertex
+{
+	int p_ix, t_ix, n_ix;
+};
 
-Mesh::Mesh()
+bool operator==(const ObjVertex& a, const ObjVertex& b)
 {
+	return a.p_ix == b.p_ix && a.t_ix == b.t_ix && a.n_ix == b.n_ix;
 }
 
-Mesh Mesh::from_objfile(ifstream& file_s)
+struct ObjVertexHash
 {
-	const int buffer_size = 1000;
-	char cwd[buffer_size];
-	getcwd(cwd, buffer_size);
-	return Mesh::from_objfile(file_s, cwd);
-}
+	size_t operator()(const ObjVertex& v) const
+	{
+		return ((size_t)v.p_ix * 73856093) ^ ((size_t)v.t_ix * 19349663) ^ ((size_t)v.n_ix * 83492791);
+	}
+};
 
-Mesh Mesh::from_objfile(ifstream& file_s, string dir)
+struct ObjParser
 {
-	Mesh m;
+	Mesh &m;
+	string dir;
 	
 	vector<Point3> points;
 	vector<Vec3> normals;
 	vector<Point2> texcoords;
 	map<string, Material*> mtls;
-	Material *current_mtl;
 	
-	while (true)
+	// Index into m.materials of each material that has been used, and of the current one. Faces
+	// that come before any usemtl get a default material.
+	map<const Material*, int> mtl_ids;
+	const Material *current_mtl;
+	int current_mtl_id;
+	
+	// The mesh vertex made from each distinct (point, texcoord, normal) triple of indices
+	unordered_map<ObjVertex, uint32_t, ObjVertexHash> vertex_ids;
+	
+	// Vertices of the face being parsed. Kept here so that its storage is reused.
+	vector<uint32_t> vertices;
+	
+	ObjParser(Mesh &_m, const string &_dir) : m(_m), dir(_dir)
+	{
+		current_mtl = NULL;
+		current_mtl_id = -1;
+	}
+	
+	~ObjParser()
+	{
+		// Free the materials that no face ended up using
+		for (map<string, Material*>::iterator it = mtls.begin(); it != mtls.end(); it++)
+			if (!mtl_ids.count((*it).second)) delete (*it).second;
+	}
+	
+	void operator()(const char *line_start, const char *line_end)
 	{
-		string line;
-		getline(file_s, line);
-		if (file_s.eof() || file_s.fail()) break;
-		stringstream line_ss(line);
+		LineReader line(line_start, line_end);
 		
-		string keyword;
-		line_ss >> keyword;
-		if (line_ss.eof() || line_ss.fail()) continue;
+		const char *keyword, *keyword_end;
+		if (!line.read_word(keyword, keyword_end)) return;
 		
-		if (keyword == "v")
+		if (word_is(keyword, keyword_end, "v"))
 		{
 			double point[3];
-			line_ss >> point[0] >> point[1] >> point[2];
-			if (line_ss.fail())
+			if (!(line.read(point[0]) && line.read(point[1]) && line.read(point[2])))
 				throw logic_error("parse error: v has bad fields");
 			points.push_back(Point3(point[0], point[1], point[2]));
 		}
-		else if (keyword == "vn")
+		else if (word_is(keyword, keyword_end, "vn"))
 		{
 			double normal[3];
-			line_ss >> normal[0] >> normal[1] >> normal[2];
-			if (line_ss.fail())
+			if (!(line.read(normal[0]) && line.read(normal[1]) && line.read(normal[2])))
 				throw logic_error("parse error: vn has bad fields");
 			normals.push_back(Vec3(normal[0], normal[1], normal[2]));
 		}
-		else if (keyword == "vt")
+		else if (word_is(keyword, keyword_end, "vt"))
 		{
 			double texcoord[2];
-			line_ss >> texcoord[0] >> texcoord[1];
-			if (line_ss.fail())
+			if (!(line.read(texcoord[0]) && line.read(texcoord[1])))
 				throw logic_error("parse error: vt hs bad fields");
 			texcoords.push_back(Point2(texcoord[0], texcoord[1]));
 		}
-		else if (keyword == "f")
+		else if (word_is(keyword, keyword_end, "f"))
 		{
-			vector<Vertex> vertices;
-			while (true)
-			{
-				string vertex_str;
-				line_ss >> vertex_str;
-				if (line_ss.fail()) break;
-				
-				stringstream vertex_ss(vertex_str);
-				
-				// Check for a comment
-				if (vertex_ss.peek() == '#') break;
-				
-				
-				int p_ix, n_ix, t_ix;
-				
-				vertex_ss >> p_ix;
-				if (vertex_ss.fail())
-					throw logic_error("parse error: vertex has bad point index");
-				
-				char sep1 = vertex_ss.get();
-				if (vertex_ss.fail())
-				{
-					n_ix = t_ix = 0;
-				}
-				else
-				{
-					if (sep1 != '/')	
-						throw logic_error("parse error: vertex point index not followed by '/'");
-				
-					vertex_ss >> t_ix;
-					if (vertex_ss.fail())
-						{ t_ix = 0; vertex_ss.clear(); }
-				
-					char sep2 = vertex_ss.get();
-					if (vertex_ss.fail())
-					{
-						n_ix = 0;
-					}
-					else
-					{
-						if (sep2 != '/')
-							throw logic_error("parse error: vertex texcoord index not followed by '/'");
-						
-						vertex_ss >> n_ix;
-						if (vertex_ss.fail())
-							{ n_ix = 0; vertex_ss.clear(); }
-					}
-				}
-					
-				
-				
-				Point3 point;
-				if (p_ix>0) point = points[p_ix-1];
-				else if (p_ix<0) point = points[points.size()+p_ix];
-				
-				Vec3 normal;
-				if (n_ix>0) normal = normals[n_ix-1];
-				else if (n_ix<0) normal = normals[normals.size()+n_ix];
-				else if (n_ix==0) normal = Vec3(0,0,0); // Parse failed (normal was omitted)
-				
-				Point2 texcoord;
-				if (t_ix>0) texcoord = texcoords[t_ix-1];
-				else if (t_ix<0) texcoord = texcoords[texcoords.size()+t_ix];
-				else if (t_ix==0) texcoord = Point2(0,0); // Parse failed (texcoord was omitted)
-				
-				vertices.push_back(Vertex(point, normal, texcoord));
-			}
-			
-			// Face in .obj file may have more than three vertices, but our Face class only supports
-			// triangles. So here we tessellate the face. We use the naive technique and assume that
-			// the face is convex.
-			for (unsigned int i=1; i+1<vertices.size(); i++)
-			{
-				m.faces.push_back(Face(vertices[0], vertices[i], vertices[i+1], current_mtl));
-			}
+			parse_face(line);
 		}
-		else if (keyword == "mtllib")
+		else if (word_is(keyword, keyword_end, "mtllib"))
 		{
 			string filename;
-			line_ss >> filename;
-			if (line_ss.fail())
+			if (!line.read_word(filename))
 				throw logic_error("parse error: expected filename after 'mtllib'");
 			
-			string filepath = dir+"/"+filename;
-			ifstream mtlfile(filepath.c_str(), ios_base::in);
-			if (!mtlfile) throw logic_error("failed to open mtl file "+filepath);
-			
-			map<string, Material*> newmtls = Material::from_mtlfile(mtlfile);
+			string filepath = dir.empty() ? filename : dir+"/"+filename;
+			map<string, Material*> newmtls = Material::from_mtlfile(filepath);
+			m.sources.push_back(filepath);
 			
 			for (map<string, Material*>::iterator it = newmtls.begin(); it != newmtls.end(); it++)
 			{
 				mtls[(*it).first] = (*it).second;
 			}
 		}
-		else if (keyword == "usemtl")
+		else if (word_is(keyword, keyword_end, "usemtl"))
 		{
 			string name;
-			line_ss >> name;
-			if (line_ss.fail())
+			if (!line.read_word(name))
 				throw logic_error("parse error: expected mtl name after 'usemtl'");
 			if (mtls.count(name)) current_mtl = mtls[name];
 			else throw logic_error("parse error: no material with specified name");
+			current_mtl_id = -1;
 		}
 	}
 	
+	void parse_face(LineReader &line)
+	{
+		vertices.clear();
+		
+		const char *vertex_str, *vertex_end;
+		while (line.read_word(vertex_str, vertex_end))
+		{
+			// Check for a comment
+			if (*vertex_str == '#') break;
+			
+			// Fields are point/texcoord/normal, and the last two are optional
+			int p_ix, n_ix, t_ix;
+			const char *p = vertex_str;
+			
+			if (!LineReader::parse_number(p, vertex_end, p_ix))
+				throw logic_error("parse error: vertex has bad point index");
+			
+			if (p == vertex_end)
+			{
+				n_ix = t_ix = 0;
+			}
+			else
+			{
+				if (*p++ != '/')
+					throw logic_error("parse error: vertex point index not followed by '/'");
+				
+				if (!LineReader::parse_number(p, vertex_end, t_ix)) t_ix = 0;
+				
+				if (p == vertex_end)
+				{
+					n_ix = 0;
+				}
+				else
+				{
+					if (*p++ != '/')
+						throw logic_error("parse error: vertex texcoord index not followed by '/'");
+					
+					if (!LineReader::parse_number(p, vertex_end, n_ix)) n_ix = 0;
+				}
+			}
+			
+			vertices.push_back(add_vertex(p_ix, t_ix, n_ix));
+		}
+		
+		if (current_mtl_id < 0)
+		{
+			if (!mtl_ids.count(current_mtl))
+			{
+				if (m.materials.size() >= Mesh::max_materials)
+					throw logic_error("parse error: too many materials");
+				if (!current_mtl) current_mtl = new Material();
+				mtl_ids[current_mtl] = m.materials.size();
+				m.materials.push_back(current_mtl);
+			}
+			current_mtl_id = mtl_ids[current_mtl];
+		}
+		
+		// Face in .obj file may have more than three vertices, but Mesh only supports
+		// triangles. So here we tessellate the face. We use the naive technique and assume that
+		// the face is convex.
+		for (unsigned int i=1; i+1<vertices.size(); i++)
+		{
+			m.indices.push_back(vertices[0]);
+			m.indices.push_back(vertices[i]);
+			m.indices.push_back(vertices[i+1]);
+			m.face_materials.push_back(current_mtl_id);
+		}
+	}
+	
+	// Returns the mesh vertex for a vertex of an .obj face, adding it if it is new
+	uint32_t add_vertex(int p_ix, int t_ix, int n_ix)
+	{
+		// Resolve relative indices. Zero means the attribute was omitted.
+		ObjVertex v;
+		v.p_ix = p_ix>0 ? p_ix-1 : p_ix<0 ? points.size()+p_ix : -1;
+		v.t_ix = t_ix>0 ? t_ix-1 : t_ix<0 ? texcoords.size()+t_ix : -1;
+		v.n_ix = n_ix>0 ? n_ix-1 : n_ix<0 ? normals.size()+n_ix : -1;
+		
+		unordered_map<ObjVertex, uint32_t, ObjVertexHash>::iterator found = vertex_ids.find(v);
+		if (found != vertex_ids.end()) return (*found).second;
+		
+		Point3 point;
+		if (v.p_ix>=0) point = points[v.p_ix];
+		
+		Vec3 normal;
+		if (v.n_ix>=0) normal = normals[v.n_ix];
+		else normal = Vec3(0,0,0); // Parse failed (normal was omitted)
+		
+		Point2 texcoord;
+		if (v.t_ix>=0) texcoord = texcoords[v.t_ix];
+		else texcoord = Point2(0,0); // Parse failed (texcoord was omitted)
+		
+		uint32_t id = m.positions.size();
+		m.positions.push_back(point);
+		m.normals.push_back(normal);
+		m.texcoords.push_back(texcoord);
+		vertex_ids[v] = id;
+		return id;
+	}
+};
+
+
+
+Mesh::Mesh()
+{
+	flat_normals = false;
+	lod_error = 0;
+}
+
+int Mesh::num_faces() const
+{
+	return indices.size() / 3;
+}
+
+void Mesh::autocompute_normals()
+{
+	vector<Point3> new_positions;
+	vector<Vec3> new_normals;
+	vector<Point2> new_texcoords;
+	vector<uint32_t> new_indices;
+	
+	for (unsigned int i=0; i<indices.size(); i+=3)
+	{
+		const Point3 &p1 = positions[indices[i]];
+		const Point3 &p2 = positions[indices[i+1]];
+		const Point3 &p3 = positions[indices[i+2]];
+		
+		Vec3 n = cross(p1 - p2, p1 - p3).normalize();
+		
+		for (int j=0; j<3; j++)
+		{
+			new_indices.push_back(new_positions.size());
+			new_positions.push_back(positions[indices[i+j]]);
+			new_normals.push_back(n);
+			new_texcoords.push_back(texcoords[indices[i+j]]);
+		}
+	}
+	
+	positions.swap(new_positions);
+	normals.swap(new_normals);
+	texcoords.swap(new_texcoords);
+	indices.swap(new_indices);
+	
+	flat_normals = true;
+	
+	// The levels of detail were simplified by the old normals
+	lods.clear();
+	lods_guard.built = false;
+}
+
+// Faces in a leaf of the hierarchy, at most
+const unsigned int bvh_leaf_size = 32;
+
+// Orders faces by one coordinate (0 for x, 1 for y, 2 for z) of their centroids
+struct CentroidOrder
+{
+	const vector<Point3> &centroids;
+	int axis;
+	
+	CentroidOrder(const vector<Point3>& _centroids, int _axis) : centroids(_centroids), axis(_axis) {}
+	
+	double key(uint32_t face) const
+	{
+		const Point3 &c = centroids[face];
+		return axis == 0 ? c.x : axis == 1 ? c.y : c.z;
+	}
+	
+	bool operator()(uint32_t a, uint32_t b) const { return key(a) < key(b); }
+};
+
+// Fits a node's box to its faces and, if it has too many, splits them in half along the longest
+// axis of their centroids' box
+static void split_bvh_node(Mesh& m, int node, const vector<Point3>& centroids)
+{
+	uint32_t first = m.bvh[node].first, count = m.bvh[node].count;
+	uint32_t *faces = &m.bvh_faces[first];
+	
+	Point3 low(INFINITY, INFINITY, INFINITY), high(-INFINITY, -INFINITY, -INFINITY);
+	Point3 c_low = low, c_high = high;
+	for (uint32_t i=0; i<count; i++)
+	{
+		for (int j=0; j<3; j++)
+		{
+			const Point3 &p = m.positions[m.indices[faces[i]*3+j]];
+			low = Point3(min(low.x, p.x), min(low.y, p.y), min(low.z, p.z));
+			high = Point3(max(high.x, p.x), max(high.y, p.y), max(high.z, p.z));
+		}
+		const Point3 &c = centroids[faces[i]];
+		c_low = Point3(min(c_low.x, c.x), min(c_low.y, c.y), min(c_low.z, c.z));
+		c_high = Point3(max(c_high.x, c.x), max(c_high.y, c.y), max(c_high.z, c.z));
+	}
+	m.bvh[node].min = low;
+	m.bvh[node].max = high;
+	m.bvh[node].children = 0;
+	if (count <= bvh_leaf_size) return;
+	
+	Vec3 extent(c_high.x - c_low.x, c_high.y - c_low.y, c_high.z - c_low.z);
+	int axis = 0;
+	if (extent.y > extent.x && extent.y >= extent.z) axis = 1;
+	else if (extent.z > extent.x && extent.z > extent.y) axis = 2;
+	
+	uint32_t half = count / 2;
+	nth_element(faces, faces + half, faces + count, CentroidOrder(centroids, axis));
+	
+	uint32_t children = m.bvh.size();
+	m.bvh[node].children = children;
+	m.bvh.resize(children + 2);
+	m.bvh[children].first = first;
+	m.bvh[children].count = half;
+	m.bvh[children+1].first = first + half;
+	m.bvh[children+1].count = count - half;
+	split_bvh_node(m, children, centroids);
+	split_bvh_node(m, children+1, centroids);
+}
+
+void Mesh::build_bvh()
+{
+	bvh.clear();
+	bvh_faces.resize(num_faces());
+	if (bvh_faces.empty()) return;
+	
+	vector<Point3> centroids(num_faces());
+	for (int f=0; f<num_faces(); f++)
+	{
+		bvh_faces[f] = f;
+		const Point3 &p1 = positions[indices[f*3]];
+		const Point3 &p2 = positions[indices[f*3+1]];
+		const Point3 &p3 = positions[indices[f*3+2]];
+		centroids[f] = Point3((p1.x+p2.x+p3.x)/3, (p1.y+p2.y+p3.y)/3, (p1.z+p2.z+p3.z)/3);
+	}
+	
+	bvh.reserve(2 * (num_faces() / (bvh_leaf_size/2) + 1));
+	bvh.resize(1);
+	bvh[0].first = 0;
+	bvh[0].count = num_faces();
+	split_bvh_node(*this, 0, centroids);
+}
+
+const Mesh& Mesh::level_of_detail(double max_error) const
+{
+	// Once the levels are built, this is all it takes to know
+	if (!lods_guard.built)
+	{
+		lock_guard<mutex> lock(lods_guard.lock);
+		if (!lods_guard.built) build_lods();
+	}
+	
+	for (int i=lods.size()-1; i>=0; i--) if (lods[i].lod_error <= max_error) return lods[i];
+	return *this;
+}
+
+void Mesh::delete_materials()
+{
+	for (unsigned int i=0; i<materials.size(); i++) delete materials[i];
+	materials.clear();
+}
+
+Mesh Mesh::from_objfile(const char *begin, const char *end, string dir)
+{
+	Mesh m;
+	try
+	{
+		ObjParser parser(m, dir);
+		for_each_line(begin, end, parser);
+	}
+	catch (...)
+	{
+		// The parser frees the materials no face used, and the mesh has the rest
+		m.delete_materials();
+		throw;
+	}
+	m.build_bvh();
 	return m;
 }
 
+Mesh Mesh::from_objfile(ifstream& file_s)
+{
+	const int buffer_size = 1000;
+	char cwd[buffer_size];
+	getcwd(cwd, buffer_size);
+	return Mesh::from_objfile(file_s, cwd);
+}
+
+Mesh Mesh::from_objfile(ifstream& file_s, string dir)
+{
+	string text = read_stream(file_s);
+	return Mesh::from_objfile(text.data(), text.data() + text.size(), dir);
+}
+
+Mesh Mesh::from_objfile(const string& path, string dir)
+{
+	MappedFile file(path);
+	if (!file.is_open()) throw logic_error("failed to open obj file "+path);
+	Mesh m = Mesh::from_objfile(file.begin(), file.end(), dir);
+	m.sources.insert(m.sources.begin(), path);
+	return m;
+}
+
+
+
+/*
+Binary mesh cache layout. Everything is in native byte order, and each section starts on an 8-byte
+boundary. The arrays are stored just as Mesh holds them in memory, so that loading one is a single
+copy out of the mapped file.
+
+	MeshCacheHeader
+	for each source file: int64 size, int64 mtime, uint32 path length, path
+	for each material: ambient, diffuse, specular (3 doubles each), shininess
+	positions (Point3s: 3 doubles per vertex)
+	normals (Vec3s: 3 doubles per vertex)
+	texcoords (Point2s: 2 doubles per vertex)
+	indices (3 uint32s per face)
+	face materials (1 uint16 per face)
+	BVH nodes (BVHNodes: min, max, first, count, children, 4 bytes of padding)
+	BVH faces (1 uint32 per face)
+*/
+
+const char cache_magic[8] = {'R','R','M','E','S','H','\r','\n'};
+const uint32_t cache_version = 2;
+const uint32_t cache_byte_order = 0x01020304;
+
+enum MeshCacheFlags
+{
+	CACHE_FLAT_NORMALS = 1
+};
+
+struct MeshCacheHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t flags;
+	uint32_t num_sources;
+	uint32_t num_vertices;
+	uint32_t num_faces;
+	uint32_t num_materials;
+	uint32_t num_bvh_nodes;
+};
+
+static_assert(is_trivially_copyable<Point3>::value && sizeof(Point3) == 3*sizeof(double) &&
+	is_trivially_copyable<Vec3>::value && sizeof(Vec3) == 3*sizeof(double) &&
+	is_trivially_copyable<Point2>::value && sizeof(Point2) == 2*sizeof(double) &&
+	is_trivially_copyable<BVHNode>::value && sizeof(BVHNode) == 64,
+	"mesh cache arrays must be stored as they are in memory");
+
+bool stat_source(const string& path, int64_t& size, int64_t& mtime)
+{
+	struct stat info;
+	if (stat(path.c_str(), &info) < 0) return false;
+	size = info.st_size;
+	mtime = info.st_mtime;
+	return true;
+}
+
+// Accumulates the cache file in memory, so that it can be written out in one go
+struct CacheWriter
+{
+	string data;
+	
+	void write(const void* bytes, size_t length) { data.append((const char*)bytes, length); }
+	void write_double(double value) { write(&value, sizeof(value)); }
+	void align() { data.append((8 - data.size()%8) % 8, '\0'); }
+};
+
+// Reads sections out of a mapped cache file, checking that they are inside it
+struct CacheReader
+{
+	const char *p, *end;
+	string path;
+	
+	const char* read(size_t length)
+	{
+		if ((size_t)(end - p) < length) throw logic_error("mesh cache file "+path+" is truncated");
+		const char *data = p;
+		p += length;
+		return data;
+	}
+	const double* read_doubles(size_t count) { return (const double*)read(count*sizeof(double)); }
+	void align(const char *begin) { read((8 - (p-begin)%8) % 8); }
+};
+
+void Mesh::write_cachefile(const string& path) const
+{
+	CacheWriter out;
+	
+	MeshCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, cache_magic, sizeof(cache_magic));
+	header.version = cache_version;
+	header.byte_order = cache_byte_order;
+	header.flags = flat_normals ? CACHE_FLAT_NORMALS : 0;
+	header.num_sources = sources.size();
+	header.num_vertices = positions.size();
+	header.num_faces = num_faces();
+	header.num_materials = materials.size();
+	header.num_bvh_nodes = bvh.size();
+	out.write(&header, sizeof(header));
+	
+	for (unsigned int i=0; i<sources.size(); i++)
+	{
+		int64_t size = -1, mtime = -1;
+		stat_source(sources[i], size, mtime);
+		uint32_t length = sources[i].size();
+		out.write(&size, sizeof(size));
+		out.write(&mtime, sizeof(mtime));
+		out.write(&length, sizeof(length));
+		out.write(sources[i].data(), length);
+		out.align();
+	}
+	
+	for (unsigned int i=0; i<materials.size(); i++)
+	{
+		const Material &mat = *materials[i];
+		const Color *colors[3] = {&mat.ambient, &mat.diffuse, &mat.specular};
+		for (int j=0; j<3; j++)
+		{
+			out.write_double(colors[j]->r);
+			out.write_double(colors[j]->g);
+			out.write_double(colors[j]->b);
+		}
+		out.write_double(mat.shininess);
+	}
+	
+	out.write(positions.data(), positions.size()*sizeof(Point3));
+	out.write(normals.data(), normals.size()*sizeof(Vec3));
+	out.write(texcoords.data(), texcoords.size()*sizeof(Point2));
+	
+	out.write(indices.data(), indices.size()*sizeof(uint32_t));
+	out.align();
+	out.write(face_materials.data(), face_materials.size()*sizeof(uint16_t));
+	out.align();
+	
+	// Node by node, so that the padding is written as zeros rather than whatever is in memory
+	const char padding[sizeof(BVHNode)] = {};
+	size_t node_size = offsetof(BVHNode, children) + sizeof(uint32_t);
+	for (unsigned int i=0; i<bvh.size(); i++)
+	{
+		out.write(&bvh[i], node_size);
+		out.write(padding, sizeof(BVHNode) - node_size);
+	}
+	out.write(bvh_faces.data(), bvh_faces.size()*sizeof(uint32_t));
+	out.align();
+	
+	// Write to a temporary file and rename it, so a reader never sees a half-written cache
+	string temp_path = path + ".tmp";
+	ofstream file(temp_path.c_str(), ios_base::out | ios_base::binary);
+	if (!file) throw logic_error("failed to open mesh cache file "+temp_path);
+	file.write(out.data.data(), out.data.size());
+	file.close();
+	if (file.fail() || rename(temp_path.c_str(), path.c_str()) < 0)
+		throw logic_error("failed to write mesh cache file "+path);
+}
+
+// The largest of the indices, or 0 if there are none
+template<typename Index> static Index max_index(const vector<Index>& indices)
+{
+	Index largest = 0;
+	for (size_t i=0; i<indices.size(); i++) largest = max(largest, indices[i]);
+	return largest;
+}
+
+// Reads a cache file into loaded, throwing logic_error if it is corrupt. Returns false if it
+// doesn't exist or is stale.
+static bool read_cachefile(const string& path, Mesh& loaded, bool check_sources)
+{
+	MappedFile file(path);
+	if (!file.is_open()) return false;
+	
+	CacheReader in;
+	in.p = file.begin();
+	in.end = file.end();
+	in.path = path;
+	
+	MeshCacheHeader header;
+	memcpy(&header, in.read(sizeof(header)), sizeof(header));
+	if (memcmp(header.magic, cache_magic, sizeof(cache_magic)) != 0)
+		throw logic_error(path+" is not a mesh cache file");
+	
+	// Caches from other versions (or machines) are just treated as stale
+	if (header.version != cache_version || header.byte_order != cache_byte_order) return false;
+	
+	loaded.flat_normals = header.flags & CACHE_FLAT_NORMALS;
+	
+	for (unsigned int i=0; i<header.num_sources; i++)
+	{
+		int64_t size, mtime;
+		uint32_t length;
+		memcpy(&size, in.read(sizeof(size)), sizeof(size));
+		memcpy(&mtime, in.read(sizeof(mtime)), sizeof(mtime));
+		memcpy(&length, in.read(sizeof(length)), sizeof(length));
+		string source(in.read(length), length);
+		in.align(file.begin());
+		
+		if (check_sources)
+		{
+			int64_t current_size, current_mtime;
+			if (!stat_source(source, current_size, current_mtime)) return false;
+			if (current_size != size || current_mtime != mtime) return false;
+		}
+		loaded.sources.push_back(source);
+	}
+	
+	if (header.num_materials > Mesh::max_materials) throw logic_error("mesh cache file "+path+" is corrupt");
+	const double *mats = in.read_doubles((size_t)header.num_materials*10);
+	for (unsigned int i=0; i<header.num_materials; i++)
+	{
+		const double *v = mats + i*10;
+		loaded.materials.push_back(new Material(
+			Color(v[0], v[1], v[2]), Color(v[3], v[4], v[5]), Color(v[6], v[7], v[8]), v[9]));
+	}
+	
+	size_t nv = header.num_vertices;
+	const Point3 *positions = (const Point3*)in.read(nv*sizeof(Point3));
+	const Vec3 *normals = (const Vec3*)in.read(nv*sizeof(Vec3));
+	const Point2 *texcoords = (const Point2*)in.read(nv*sizeof(Point2));
+	loaded.positions.assign(positions, positions + nv);
+	loaded.normals.assign(normals, normals + nv);
+	loaded.texcoords.assign(texcoords, texcoords + nv);
+	
+	size_t nf = header.num_faces;
+	const uint32_t *indices = (const uint32_t*)in.read(nf*3*sizeof(uint32_t));
+	in.align(file.begin());
+	const uint16_t *face_materials = (const uint16_t*)in.read(nf*sizeof(uint16_t));
+	in.align(file.begin());
+	loaded.indices.assign(indices, indices + nf*3);
+	loaded.face_materials.assign(face_materials, face_materials + nf);
+	
+	size_t nn = header.num_bvh_nodes;
+	const BVHNode *bvh = (const BVHNode*)in.read(nn*sizeof(BVHNode));
+	const uint32_t *bvh_faces = (const uint32_t*)in.read(nf*sizeof(uint32_t));
+	loaded.bvh.assign(bvh, bvh + nn);
+	loaded.bvh_faces.assign(bvh_faces, bvh_faces + nf);
+	
+	// Everything else is used as it is, but an index out of range would be read past the end of
+	// an array. Taking the largest of each is cheaper than checking them one by one.
+	if (nf > 0 && (max_index(loaded.indices) >= nv || max_index(loaded.bvh_faces) >= nf ||
+		max_index(loaded.face_materials) >= loaded.materials.size() || nn == 0))
+		throw logic_error("mesh cache file "+path+" is corrupt");
+	
+	// A node's faces must be in range, and its children after it, so that walking the hierarchy
+	// ends
+	for (size_t i=0; i<nn; i++)
+	{
+		const BVHNode &node = loaded.bvh[i];
+		if (node.first > nf || node.count > nf - node.first ||
+			(node.children != 0 && (node.children <= i || node.children >= nn - 1)))
+			throw logic_error("mesh cache file "+path+" is corrupt");
+	}
+	
+	return true;
+}
+
+bool Mesh::from_cachefile(const string& path, Mesh& m, bool check_sources)
+{
+	// A cache that can't be read is no use either, so it is treated just like a stale one
+	Mesh loaded;
+	bool read;
+	try
+	{
+		read = read_cachefile(path, loaded, check_sources);
+	}
+	catch (const logic_error&)
+	{
+		read = false;
+	}
+	if (!read)
+	{
+		loaded.delete_materials();
+		return false;
+	}
+	
+	m = move(loaded);
+	return true;
+}
+
 
 
 SunLight::SunLight(const Vec3& _direction, const Color& _color)
@@ -4,6 +4,10 @@
 #include <fstream>
 #include <map>
 #include <list>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <inttypes.h>
 
 using namespace std;
 
@@ -15,8 +19,6 @@ using namespace std;
 
 
 struct Material;
-struct Vertex;
-struct Face;
 struct Mesh;
 
 
@@ -30,44 +32,121 @@ struct Material
 	Material(const Color&, const Color&, const Color&, double);
 	
 	static map<string, Material*> from_mtlfile(ifstream&);
+	static map<string, Material*> from_mtlfile(const string& path);
+	static map<string, Material*> from_mtlfile(const char* begin, const char* end);
 };
 
 
 
-struct Vertex
+// A node of a mesh's bounding volume hierarchy: the box around the faces bvh_faces[first] to
+// bvh_faces[first+count-1]. An inner node's children are the nodes at children and children+1, and
+// a leaf has children 0.
+struct BVHNode
 {
-	Point3 point;
-	Vec3 normal;
-	Point2 texcoord;
-	
-	Vertex();
-	Vertex(const Point3&, const Vec3&, const Point2&);
+	Point3 min, max;
+	uint32_t first, count;
+	uint32_t children;
 };
 
 
 
-struct Face
+// Whether a mesh's levels of detail have been built, and the lock held while building them. Each
+// mesh has its own, so that building one mesh's levels doesn't hold up renders of any other. A
+// copy starts with its own lock, and with whether the levels it was copied with were built.
+struct LodsGuard
 {
-	Vertex vertices[3];
-	const Material* material;
-	
-	Face(const Vertex&, const Vertex&, const Vertex&, const Material*);
+	mutex lock;
+	atomic<bool> built;
 	
-	void autocompute_normals();
+	LodsGuard() : built(false) {}
+	LodsGuard(const LodsGuard& other) : built(other.built.load()) {}
+	LodsGuard& operator=(const LodsGuard& other) { built = other.built.load(); return *this; }
 };
 
 
 
+// An indexed triangle mesh. Vertex attributes are kept in parallel arrays, so a vertex shared by
+// several faces is only stored (and only needs transforming) once.
 struct Mesh
 {
-	list<Face> faces;
+	// Vertex i is made of positions[i], normals[i] and texcoords[i]
+	vector<Point3> positions;
+	vector<Vec3> normals;
+	vector<Point2> texcoords;
+	
+	// Three vertex indices per face
+	vector<uint32_t> indices;
+	
+	// The material of each face, as an index into materials. The renderer uses 0xffff for
+	// "no material", so a mesh can have at most max_materials of them.
+	vector<uint16_t> face_materials;
+	static constexpr unsigned int max_materials = 0xffff;
+	vector<const Material*> materials;
+	
+	// Whether autocompute_normals() has been applied
+	bool flat_normals;
+	
+	// A bounding volume hierarchy over the faces, so that renders can skip the groups of faces
+	// that fall outside the view. Node 0 is the root. The loaders build it (a cache file stores
+	// it), and anything else that changes the faces or positions should call build_bvh() again (a
+	// mesh with no hierarchy is just drawn whole).
+	vector<BVHNode> bvh;
+	vector<uint32_t> bvh_faces;
+	
+	// Simplified versions of the mesh, finest first, for drawing it small. Each is a mesh of its
+	// own (with its own hierarchy) sharing this one's materials, and its lod_error is how far its
+	// surface (and its shading) may stray from this one's, in the mesh's units. They are only built
+	// the first time level_of_detail() is asked for one, so loading a mesh that is never drawn
+	// small doesn't pay for simplifying it. lod_error is 0 for a mesh that isn't simplified.
+	mutable vector<Mesh> lods;
+	mutable LodsGuard lods_guard;
+	double lod_error;
+	
+	// The files the mesh was loaded from (the .obj file and its .mtl files)
+	vector<string> sources;
 	
 	Mesh();
 	
+	int num_faces() const;
+	
+	// Gives every face its own vertices, with the face's flat normal (and drops any levels of
+	// detail, to be remade to match)
+	void autocompute_normals();
+	
+	void build_bvh();
+	
+	// Builds lods now, by quadric edge collapse (see Simplify.cpp). Each level has about three
+	// quarters of the faces of the one before.
+	void build_lods() const;
+	
+	// The coarsest of the mesh's levels of detail whose error is at most max_error, or the mesh
+	// itself if there is none. Builds the levels if they haven't been yet, so it is safe to call
+	// from several threads at once, but not while the mesh is being changed.
+	const Mesh& level_of_detail(double max_error) const;
+	
+	// Materials aren't reference counted, so whoever owns the last copy of a mesh may free them
+	// with this
+	void delete_materials();
+	
+	// Saves the mesh in a binary format which can be loaded back without any parsing. The file
+	// also records the size and modification time of each source file.
+	void write_cachefile(const string& path) const;
+	
+	// Loads a mesh saved by write_cachefile(). Returns false if the file doesn't exist, isn't a
+	// mesh cache, is corrupt or truncated, or was written by another version or, when
+	// check_sources is set, if any of the mesh's source files has changed since it was saved.
+	static bool from_cachefile(const string& path, Mesh&, bool check_sources = true);
+	
 	static Mesh from_objfile(ifstream&);
 	static Mesh from_objfile(ifstream&, string dir); // dir specifies where to look for .mtl files
+	static Mesh from_objfile(const string& path, string dir);
+	static Mesh from_objfile(const char* begin, const char* end, string dir);
 };
 
+// Looks up the size and modification time of a file, as recorded in mesh cache files. Returns
+// false if it can't be found.
+bool stat_source(const string& path, int64_t& size, int64_t& mtime);
+
 
 
 struct SunLight
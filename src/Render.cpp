@@ -1,60 +1,341 @@
 #include "Render.h"
+#include "Shading.h"
+#include "SimdMath.h"
+#include "ThreadPool.h"
 
 #include <iostream>
 #include <vector>
 #include <math.h>
+#include <inttypes.h>
+#include <mutex>
 
 
-/*
-TODO:
 
-Add methods to the Image class for blitting images. Same with the Array2D<T> class?
+// Vertices are snapped to a fixed-point grid with this many bits below the pixel before
+// rasterization, so that the edge functions can be evaluated exactly with integers.
+const int subpixel_bits = 8;
+const int64_t subpixel_one = 1 << subpixel_bits;
 
-Make Image only another specialization (or subclass) of Array2D?
-*/
+// Vertices further than this many pixels from the origin could overflow the 64-bit edge
+// functions, so triangles touching them are dropped. This is far outside any sane canvas.
+const double guard_band = 1 << 22;
 
+// A transformed vertex, snapped to the fixed-point grid. Vertices outside the guard band can't
+// be, and aren't usable.
+struct SnappedVertex
+{
+	int64_t x, y;
+	bool usable;
+};
 
+// A face that has been transformed to screen space and survived culling, along with the
+// pixels it might cover. The normals are in screen space too. At double precision the vertices'
+// normals are in normals, and at float precision they are in attributes instead, with the depth
+// in the fourth lane, so that both are interpolated at once.
+// 
+// The edge functions are worked out once here, rather than by every tile the face is drawn in.
+// Edge i is E(x,y) = a[i]*x + b[i]*y + c[i], with x and y in subpixels, and is the edge opposite
+// vertex order[i], which is the vertices' order made counterclockwise so that every edge function
+// is positive inside. A sample on the edge is covered if E + bias[i] >= 0. x1 to x2 and y1 to y2
+// are the samples inside the snapped vertices' bounds, clipped to the screen.
+struct TriangleSetup
+{
+	Point3 points[3];
+	Vec3 normals[3];
+	Vec4f attributes[3];
+	uint16_t material;
+	int x1, y1, x2, y2;
+	
+	int64_t a[3], b[3], c[3], bias[3];
+	int order[3];
+	double inv_area;
+};
+
+// Marks G-buffer samples that no face covers
+const uint16_t no_material = 0xffff;
+
+// One sample of the G-buffer, at full precision. Materials are indices into the mesh's material
+// table.
+struct FullSample
+{
+	double depth;
+	Vec3 normal;
+	uint16_t material;
+	
+	double get_depth() const { return depth; }
+	Vec3 get_normal() const { return normal; }
+	
+	// The depth as get_depth() gives it back after set()
+	static double stored_depth(double d) { return d; }
+	
+	void set(double _depth, const Vec3& _normal, uint16_t _material)
+	{
+		depth = _depth;
+		normal = _normal;
+		material = _material;
+	}
+};
 
-void render_core(
+// One sample of the G-buffer, packed into 12 bytes: a float depth, and the normal in octahedral
+// encoding as two 16-bit fixed-point numbers. Octahedral encoding folds the unit sphere onto a
+// square, so a unit vector fits in two numbers with about the same precision everywhere.
+struct PackedSample
+{
+	float depth;
+	int16_t normal[2];
+	uint16_t material;
+	
+	double get_depth() const { return depth; }
+	static double stored_depth(double d) { return (float)d; }
+	
+	Vec3 get_normal() const
+	{
+		double u = normal[0] * (1.0 / 32767), v = normal[1] * (1.0 / 32767);
+		double z = 1 - fabs(u) - fabs(v);
+		if (z < 0)
+		{
+			double fu = (1 - fabs(v)) * (u >= 0 ? 1 : -1);
+			double fv = (1 - fabs(u)) * (v >= 0 ? 1 : -1);
+			u = fu;
+			v = fv;
+		}
+		return Vec3(u, v, z).normalize();
+	}
+	
+	void set(double _depth, const Vec3& _normal, uint16_t _material)
+	{
+		depth = _depth;
+		material = _material;
+		
+		double l1 = fabs(_normal.x) + fabs(_normal.y) + fabs(_normal.z);
+		double u = 0, v = 0;
+		if (l1 > 0)
+		{
+			u = _normal.x / l1;
+			v = _normal.y / l1;
+			if (_normal.z < 0)
+			{
+				double fu = (1 - fabs(v)) * (u >= 0 ? 1 : -1);
+				double fv = (1 - fabs(u)) * (v >= 0 ? 1 : -1);
+				u = fu;
+				v = fv;
+			}
+		}
+		normal[0] = (int16_t)(u * 32767 + (u < 0 ? -0.5 : 0.5));
+		normal[1] = (int16_t)(v * 32767 + (v < 0 ? -0.5 : 0.5));
+	}
+};
+
+// Working memory for rendering one pose. Scratch objects are kept after use and handed to later
+// renders, so that repeated renders (of a batch of poses, or of many jobs in server mode) don't
+// have to allocate their buffers all over again.
+struct RenderScratch
+{
+	// The final G-buffer, covering the viewport. Only the one in the format being rendered is used.
+	Array2D<FullSample> full_gbuffer;
+	Array2D<PackedSample> packed_gbuffer;
+	
+	// Which faces might be on screen, and the vertices they use, when some of the mesh is not
+	vector<uint8_t> face_flags;
+	vector<uint8_t> vertex_flags;
+	
+	// Transformed vertices (at one precision or the other), their positions snapped for the
+	// rasterizer, and the triangles set up from them
+	vector<Point3> positions;
+	vector<Vec3> normals;
+	vector<Vec4f> positions_f;
+	vector<Vec4f> normals_f;
+	vector<SnappedVertex> snapped;
+	vector<TriangleSetup> triangles;
+	vector< pair<double, int> > draw_order;
+	vector< vector<int> > bins;
+	
+	// The shading table of each of the mesh's materials, made as they are needed
+	vector< shared_ptr<ShadingTable> > shading_tables;
+	
+	// Fragments gathered by material for deferred shading. Material m's are from
+	// material_starts[m] to material_ends[m] in the batch, and pixel i's is fragment_slots[i].
+	FragmentBatch fragments;
+	vector<int> fragment_slots;
+	vector<int> material_starts;
+	vector<int> material_ends;
+	
+	// The G-buffer's depths and materials for the outline pass, with a border of one pixel
+	vector<double> outline_depths;
+	vector<double> outline_materials;
+	
+	RenderScratch();
+};
+
+RenderScratch* acquire_scratch();
+void release_scratch(RenderScratch*);
+
+// Which samples of a pixel are taken. The mesh is rasterized on a grid this many times finer
+// than the pixels, and supersampled row y only takes the samples at x = offsets[y % step] +
+// k*step. That is every sample for a regular grid (step 1), and one per pixel for a sparse
+// pattern (step = grid).
+struct SampleLayout
+{
+	int grid;
+	int step;
+	const int *offsets;
+	
+	// Samples taken in each supersampled row of a pixel
+	int columns() const { return grid / step; }
+};
+
+SampleLayout sample_layout(const RenderOptions&);
+
+template<typename Canvas, typename Lighting> void render_viewport(
+	const Mesh& mesh,
+	const Matrix4& transform,
+	const Lighting& lighting,
+	Canvas& canvas,
+	const Viewport& requested_viewport,
+	const RenderOptions& options);
+
+template<typename Sample, typename Canvas, typename Lighting> void render_gbuffer(
 	const Mesh& mesh,
 	const Matrix4& transform,
-	Array2D<double>& depth_buffer,
-	Array2D<Vec3>& normal_buffer,
-	Array2D<const Material*>& material_buffer,
-	CullMode cullmode = CULL_NONE);
+	const Lighting& lighting,
+	Canvas& canvas,
+	const Viewport& viewport,
+	Array2D<Sample>& gbuffer,
+	RenderScratch& scratch,
+	const RenderOptions& options);
 
-void supersample(
+template<typename Sample> void render_core(
 	const Mesh& mesh,
 	const Matrix4& transform,
-	Array2D<double>& depth_buffer,
-	Array2D<Vec3>& normal_buffer,
-	Array2D<const Material*>& material_buffer,
-	int ssf,
-	CullMode cullmode = CULL_NONE);
-
-Color light_fragment(
-	const Vec3& loc,
-	const Vec3& normal,
-	const Material& mat,
-	const list<SunLight>& lights);
-
-void outline_discontinuities(
+	Array2D<Sample>& gbuffer,
+	RenderScratch& scratch,
+	const RenderOptions& options);
+
+template<typename Sample> void shade(
+	const Mesh& mesh,
+	const list<SunLight>& lights,
 	Image& canvas,
-	Array2D<double> &depth_buffer,
-	Array2D<Vec3> &normal_buffer,
-	Array2D<const Material*> &material_buffer);
+	const Viewport& viewport,
+	Array2D<Sample>& gbuffer,
+	RenderScratch& scratch,
+	const RenderOptions& options);
 
-void outline_material_bounds(
+template<typename Sample> void shade(
+	const Mesh& mesh,
+	const ShadingPalette& palette,
+	IndexedImage& canvas,
+	const Viewport& viewport,
+	Array2D<Sample>& gbuffer,
+	RenderScratch& scratch,
+	const RenderOptions& options);
+
+template<typename Sample> void shade_deferred(
+	const Mesh& mesh,
+	const list<SunLight>& lights,
 	Image& canvas,
-	Array2D<double> &depth_buffer,
-	Array2D<Vec3> &normal_buffer,
-	Array2D<const Material*> &material_buffer);
+	const Viewport& viewport,
+	Array2D<Sample>& gbuffer,
+	RenderScratch& scratch);
+
+template<typename Sample, typename Canvas> void outline(
+	Canvas& canvas,
+	const Viewport& viewport,
+	Array2D<Sample> &gbuffer,
+	RenderScratch& scratch,
+	OutlineStyle style);
+
+template<typename Visitor> void rasterize_triangle(
+	const TriangleSetup& triangle,
+	const Viewport& clip,
+	const SampleLayout& layout,
+	Visitor& visit);
 
-vector< pair<Point2,Vec3> > rasterize_triangle(Point2 p1, Point2 p2, Point2 p3);
 
 
+Viewport::Viewport(int _x, int _y, int _width, int _height)
+{
+	x = _x;
+	y = _y;
+	width = _width;
+	height = _height;
+}
+
+
+
+RenderScratch::RenderScratch() :
+	full_gbuffer(0, 0),
+	packed_gbuffer(0, 0)
+{
+}
 
-const Vec3 eye(0,0,1);
+// Idle scratch objects, most recently used first. The oldest are freed once there are more than
+// max_idle_scratch of them.
+struct IdleScratch
+{
+	mutex lock;
+	list<RenderScratch*> items;
+	
+	~IdleScratch()
+	{
+		for (list<RenderScratch*>::iterator it = items.begin(); it != items.end(); it++)
+			delete *it;
+	}
+};
+
+static IdleScratch idle_scratch;
+const unsigned int max_idle_scratch = 16;
+
+RenderScratch* acquire_scratch()
+{
+	unique_lock<mutex> guard(idle_scratch.lock);
+	if (idle_scratch.items.empty()) return new RenderScratch;
+	RenderScratch *scratch = idle_scratch.items.front();
+	idle_scratch.items.pop_front();
+	return scratch;
+}
+
+void release_scratch(RenderScratch* scratch)
+{
+	unique_lock<mutex> guard(idle_scratch.lock);
+	idle_scratch.items.push_front(scratch);
+	while (idle_scratch.items.size() > max_idle_scratch)
+	{
+		delete idle_scratch.items.back();
+		idle_scratch.items.pop_back();
+	}
+}
+
+
+
+RenderOptions::RenderOptions()
+{
+	cullmode = CULL_NONE;
+	samples = SAMPLES_GRID;
+	supersampling = 3;
+	gbuffer = GBUFFER_FULL;
+	precision = PRECISION_FLOAT;
+	shading = SHADING_EXACT;
+	outline = OUTLINE_MATERIAL;
+	order = ORDER_MESH;
+	attributes = ATTRIBUTES_IMMEDIATE;
+	detail = DETAIL_FULL;
+	pool = NULL;
+}
+
+RenderOptions::RenderOptions(CullMode _cullmode)
+{
+	cullmode = _cullmode;
+	samples = SAMPLES_GRID;
+	supersampling = 3;
+	gbuffer = GBUFFER_FULL;
+	precision = PRECISION_FLOAT;
+	shading = SHADING_EXACT;
+	outline = OUTLINE_MATERIAL;
+	order = ORDER_MESH;
+	attributes = ATTRIBUTES_IMMEDIATE;
+	detail = DETAIL_FULL;
+	pool = NULL;
+}
 
 
 
@@ -63,370 +344,1320 @@ void render(
 	const Matrix4& transform,
 	const list<SunLight>& lights,
 	Image& canvas,
-	CullMode cullmode)
+	const RenderOptions& options)
+{
+	render(mesh, transform, lights, canvas, Viewport(0, 0, canvas.width, canvas.height), options);
+}
+
+void render(
+	const Mesh& mesh,
+	const Matrix4& transform,
+	const list<SunLight>& lights,
+	Image& canvas,
+	const Viewport& viewport,
+	const RenderOptions& options)
+{
+	render_viewport(mesh, transform, lights, canvas, viewport, options);
+}
+
+void render(
+	const Mesh& mesh,
+	const Matrix4& transform,
+	const ShadingPalette& palette,
+	IndexedImage& canvas,
+	const RenderOptions& options)
+{
+	render(mesh, transform, palette, canvas, Viewport(0, 0, canvas.width, canvas.height), options);
+}
+
+void render(
+	const Mesh& mesh,
+	const Matrix4& transform,
+	const ShadingPalette& palette,
+	IndexedImage& canvas,
+	const Viewport& viewport,
+	const RenderOptions& options)
+{
+	render_viewport(mesh, transform, palette, canvas, viewport, options);
+}
+
+// Renders with either kind of canvas: an Image lit by a list of lights, or an IndexedImage
+// shaded with a palette
+template<typename Canvas, typename Lighting> void render_viewport(
+	const Mesh& mesh,
+	const Matrix4& transform,
+	const Lighting& lighting,
+	Canvas& canvas,
+	const Viewport& requested_viewport,
+	const RenderOptions& options)
 {
-	Array2D<double> depth_buffer(canvas.width, canvas.height);
-	Array2D<Vec3> normal_buffer(canvas.width, canvas.height);
-	Array2D<const Material*> material_buffer(canvas.width, canvas.height);
+	// Clip the viewport to the canvas
+	int x1 = max(requested_viewport.x, 0);
+	int y1 = max(requested_viewport.y, 0);
+	int x2 = min(requested_viewport.x + requested_viewport.width, canvas.width);
+	int y2 = min(requested_viewport.y + requested_viewport.height, canvas.height);
+	if (x2 <= x1 || y2 <= y1) return;
+	Viewport viewport(x1, y1, x2-x1, y2-y1);
 	
-	supersample(mesh, transform, depth_buffer, normal_buffer, material_buffer, 3, cullmode);
+	// The buffers only cover the viewport, so move the viewport's corner to the origin
+	Matrix4 transform2 = Matrix4::translation(Vec3(-viewport.x, -viewport.y, 0)) * transform;
 	
-	for (int x=0; x<canvas.width; x++) for (int y=0; y<canvas.height; y++)
+	RenderScratch *scratch = acquire_scratch();
+	if (options.gbuffer == GBUFFER_PACKED)
+		render_gbuffer(mesh, transform2, lighting, canvas, viewport, scratch->packed_gbuffer, *scratch, options);
+	else
+		render_gbuffer(mesh, transform2, lighting, canvas, viewport, scratch->full_gbuffer, *scratch, options);
+	release_scratch(scratch);
+}
+
+// Renders into a G-buffer covering the viewport, then lights and outlines it onto the canvas
+template<typename Sample, typename Canvas, typename Lighting> void render_gbuffer(
+	const Mesh& mesh,
+	const Matrix4& transform,
+	const Lighting& lighting,
+	Canvas& canvas,
+	const Viewport& viewport,
+	Array2D<Sample>& gbuffer,
+	RenderScratch& scratch,
+	const RenderOptions& options)
+{
+	gbuffer.resize(viewport.width, viewport.height);
+	
+	render_core(mesh, transform, gbuffer, scratch, options);
+	
+	shade(mesh, lighting, canvas, viewport, gbuffer, scratch, options);
+	
+	if (options.outline != OUTLINE_NONE) outline(canvas, viewport, gbuffer, scratch, options.outline);
+}
+
+// Lights the G-buffer onto the canvas, by the options' shading mode
+template<typename Sample> void shade(
+	const Mesh& mesh,
+	const list<SunLight>& lights,
+	Image& canvas,
+	const Viewport& viewport,
+	Array2D<Sample>& gbuffer,
+	RenderScratch& scratch,
+	const RenderOptions& options)
+{
+	if (options.shading == SHADING_TABLE)
 	{
-		if (material_buffer(x,y))
+		vector< shared_ptr<ShadingTable> > &tables = scratch.shading_tables;
+		tables.assign(mesh.materials.size(), NULL);
+		
+		for (int y=0; y<viewport.height; y++) for (int x=0; x<viewport.width; x++)
 		{
-			canvas(x,y) = light_fragment(
-				Vec3(x,y,depth_buffer(x,y)),
-				normal_buffer(x,y),
-				*material_buffer(x,y),
-				lights);
+			const Sample &sample = gbuffer(x,y);
+			if (sample.material == no_material) continue;
+			
+			shared_ptr<ShadingTable> &table = tables[sample.material];
+			if (!table) table = shading_table(*mesh.materials[sample.material], lights);
+			canvas(viewport.x+x, viewport.y+y) = table->shade(sample.get_normal());
 		}
+		tables.clear();
+	}
+	else
+	{
+		shade_deferred(mesh, lights, canvas, viewport, gbuffer, scratch);
 	}
-	
-	outline_material_bounds(canvas, depth_buffer, normal_buffer, material_buffer);
 }
 
-void outline_discontinuities(
-	Image& canvas,
-	Array2D<double> &depth_buffer,
-	Array2D<Vec3> &normal_buffer,
-	Array2D<const Material*> &material_buffer)
+// Shades the G-buffer to palette indices. Runs of pixels with the same material and normal (as
+// on flat faces) are only shaded once.
+template<typename Sample> void shade(
+	const Mesh& mesh,
+	const ShadingPalette& palette,
+	IndexedImage& canvas,
+	const Viewport& viewport,
+	Array2D<Sample>& gbuffer,
+	RenderScratch& scratch,
+	const RenderOptions& options)
 {
-	for (int x=0; x<canvas.width; x++) for (int y=0; y<canvas.height; y++)
+	uint16_t last_material = no_material;
+	Vec3 last_normal;
+	uint8_t last_index = 0;
+	
+	for (int y=0; y<viewport.height; y++)
 	{
-		const int xoffs[4] = {1, -1, 0, 0};
-		const int yoffs[4] = {0, 0, 1, -1};
-		
-		double diff = 0;
-		for (int offi=0; offi<4; offi++)
+		uint8_t *row = &canvas(viewport.x, viewport.y+y);
+		for (int x=0; x<viewport.width; x++)
 		{
-			int x2 = x+xoffs[offi], y2 = y+yoffs[offi];
-			if (x2<0 || x2>=canvas.width || y2<0 || y2>=canvas.height) continue;
+			const Sample &sample = gbuffer(x,y);
+			if (sample.material == no_material) continue;
 			
-			if (isfinite(depth_buffer(x2,y2)) && isfinite(depth_buffer(x,y)))
-			{
-				Vec3 n = normal_buffer(x,y);
-				double expected_depth =
-					depth_buffer(x,y) -
-					xoffs[offi]*n.x/n.z -
-					yoffs[offi]*n.y/n.z;
-				if (expected_depth > depth_buffer(x2,y2))
-					diff += expected_depth - depth_buffer(x2,y2);
-			}
-			else if (!isfinite(depth_buffer(x,y)) && isfinite(depth_buffer(x2,y2)) )
+			Vec3 normal = sample.get_normal();
+			if (sample.material != last_material ||
+				normal.x != last_normal.x || normal.y != last_normal.y || normal.z != last_normal.z)
 			{
-				diff = INFINITY;
+				last_material = sample.material;
+				last_normal = normal;
+				last_index = palette.shade(sample.material, normal);
 			}
+			row[x] = last_index;
+		}
+	}
+}
+
+
+// Lights the G-buffer onto the canvas a material at a time. Covered pixels are gathered into a
+// batch grouped by material, and a pixel with the same normal as the previous one of its
+// material shares that pixel's fragment, so flat faces are lit once per run instead of once per
+// pixel. Then each material's fragments are shaded together, and the colors scattered back.
+template<typename Sample> void shade_deferred(
+	const Mesh& mesh,
+	const list<SunLight>& lights,
+	Image& canvas,
+	const Viewport& viewport,
+	Array2D<Sample>& gbuffer,
+	RenderScratch& scratch)
+{
+	int num_materials = mesh.materials.size();
+	FragmentBatch &batch = scratch.fragments;
+	vector<int> &slots = scratch.fragment_slots;
+	vector<int> &starts = scratch.material_starts;
+	vector<int> &ends = scratch.material_ends;
+	
+	// Count each material's pixels, to find where its fragments start
+	starts.assign(num_materials+1, 0);
+	for (int y=0; y<viewport.height; y++) for (int x=0; x<viewport.width; x++)
+	{
+		uint16_t material = gbuffer(x,y).material;
+		if (material != no_material) starts[material+1]++;
+	}
+	for (int m=0; m<num_materials; m++) starts[m+1] += starts[m];
+	ends.assign(starts.begin(), starts.end()-1);
+	
+	batch.resize(starts[num_materials]);
+	slots.resize(viewport.width*viewport.height);
+	
+	for (int y=0; y<viewport.height; y++) for (int x=0; x<viewport.width; x++)
+	{
+		int &slot = slots[x + y*viewport.width];
+		const Sample &sample = gbuffer(x,y);
+		if (sample.material == no_material)
+		{
+			slot = -1;
+			continue;
 		}
 		
-		double adjust = diff / 10;
-		canvas(x,y).r -= adjust;
-		canvas(x,y).g -= adjust;
-		canvas(x,y).b -= adjust;
+		Vec3 normal = sample.get_normal();
+		int &end = ends[sample.material];
+		if (end > starts[sample.material] &&
+			batch.nx[end-1] == normal.x && batch.ny[end-1] == normal.y && batch.nz[end-1] == normal.z)
+		{
+			slot = end-1;
+		}
+		else
+		{
+			batch.nx[end] = normal.x;
+			batch.ny[end] = normal.y;
+			batch.nz[end] = normal.z;
+			slot = end++;
+		}
 	}
+	
+	for (int m=0; m<num_materials; m++)
+		if (ends[m] > starts[m]) shade_fragments(*mesh.materials[m], lights, batch, starts[m], ends[m]);
+	
+	for (int y=0; y<viewport.height; y++) for (int x=0; x<viewport.width; x++)
+	{
+		int slot = slots[x + y*viewport.width];
+		if (slot >= 0) canvas(viewport.x+x, viewport.y+y) = Color(batch.r[slot], batch.g[slot], batch.b[slot]);
+	}
+}
+
+
+Pose::Pose(const Matrix4& _transform, const Viewport& _viewport) :
+	transform(_transform),
+	viewport(_viewport)
+{
 }
 
+template<typename Canvas, typename Lighting> struct BatchContext
+{
+	const Mesh *mesh;
+	const vector<Pose> *poses;
+	const Lighting *lighting;
+	Canvas *canvas;
+	const RenderOptions *options;
+};
+
+template<typename Canvas, typename Lighting> void render_pose(int i, void* _context)
+{
+	BatchContext<Canvas, Lighting> &context = *(BatchContext<Canvas, Lighting>*)_context;
+	const Pose &pose = (*context.poses)[i];
+	render_viewport(*context.mesh, pose.transform, *context.lighting, *context.canvas, pose.viewport, *context.options);
+}
 
+template<typename Canvas, typename Lighting> void render_poses(
+	const Mesh& mesh,
+	const vector<Pose>& poses,
+	const Lighting& lighting,
+	Canvas& canvas,
+	const RenderOptions& options)
+{
+	BatchContext<Canvas, Lighting> context;
+	context.mesh = &mesh;
+	context.poses = &poses;
+	context.lighting = &lighting;
+	context.canvas = &canvas;
+	context.options = &options;
+	
+	if (options.pool) options.pool->run(poses.size(), render_pose<Canvas, Lighting>, &context);
+	else for (unsigned int i=0; i<poses.size(); i++) render_pose<Canvas, Lighting>(i, &context);
+}
 
-void outline_material_bounds(
+void render_batch(
+	const Mesh& mesh,
+	const vector<Pose>& poses,
+	const list<SunLight>& lights,
 	Image& canvas,
-	Array2D<double> &depth_buffer,
-	Array2D<Vec3> &normal_buffer,
-	Array2D<const Material*> &material_buffer)
+	const RenderOptions& options)
+{
+	render_poses(mesh, poses, lights, canvas, options);
+}
+
+void render_batch(
+	const Mesh& mesh,
+	const vector<Pose>& poses,
+	const ShadingPalette& palette,
+	IndexedImage& canvas,
+	const RenderOptions& options)
 {
-	for (int x=0; x<canvas.width; x++) for (int y=0; y<canvas.height; y++)
+	render_poses(mesh, poses, palette, canvas, options);
+}
+
+// Outline pixels of either kind of canvas
+static inline void blacken(Color& c) { c = Color(0,0,0); }
+static inline void blacken(uint8_t& i) { i = ShadingPalette::outline; }
+
+static inline void darken(Color& c, double adjust)
+{
+	c.r -= adjust;
+	c.g -= adjust;
+	c.b -= adjust;
+}
+static inline void darken(uint8_t& i, double adjust)
+{
+	if (adjust >= 0.5) i = ShadingPalette::outline;
+}
+
+// Darkens edges on the canvas, in one pass over the rows of the G-buffer. With OUTLINE_MATERIAL,
+// a pixel is blacked out if a neighbour (left, right, above or below) has another material and is
+// in front of it. With OUTLINE_DISCONTINUITY, a pixel is darkened by how far its neighbours are
+// in front of the plane through it, and blacked out if it is background next to a covered pixel.
+// 
+// The depths and materials are copied into arrays with a border around them, so that the inner
+// loops need no bounds checks. Border depths are infinite for OUTLINE_MATERIAL (nothing can be in
+// front of them) and NaN for OUTLINE_DISCONTINUITY (every comparison with them fails). Material
+// indices are stored as doubles, so both can be compared two pixels at a time.
+// 
+// On an indexed canvas, outlined pixels take the palette's outline color, and OUTLINE_DISCONTINUITY
+// (which can't darken a color by just any amount) outlines the pixels it would darken by half or
+// more.
+template<typename Sample, typename Canvas> void outline(
+	Canvas& canvas,
+	const Viewport& viewport,
+	Array2D<Sample> &gbuffer,
+	RenderScratch& scratch,
+	OutlineStyle style)
+{
+	int width = viewport.width, height = viewport.height;
+	int stride = width + 2;
+	vector<double> &depths = scratch.outline_depths;
+	vector<double> &materials = scratch.outline_materials;
+	
+	double border = style == OUTLINE_MATERIAL ? INFINITY : NAN;
+	depths.assign(stride * (height+2), border);
+	materials.assign(stride * (height+2), -1);
+	for (int y=0; y<height; y++)
 	{
-		const int xoffs[4] = {1, -1, 0, 0};
-		const int yoffs[4] = {0, 0, 1, -1};
+		double *depth_row = &depths[(y+1)*stride + 1];
+		double *material_row = &materials[(y+1)*stride + 1];
+		for (int x=0; x<width; x++)
+		{
+			const Sample &sample = gbuffer(x,y);
+			depth_row[x] = sample.get_depth();
+			material_row[x] = sample.material;
+		}
+	}
+	
+	for (int y=0; y<height; y++)
+	{
+		const double *d = &depths[(y+1)*stride + 1];
+		const double *m = &materials[(y+1)*stride + 1];
+		const double *d_up = d - stride, *d_down = d + stride;
+		const double *m_up = m - stride, *m_down = m + stride;
+		typename Canvas::Value *row = &canvas(viewport.x, viewport.y+y);
 		
-		bool change = false;
-		for (int offi=0; offi<4; offi++)
+		if (style == OUTLINE_MATERIAL)
 		{
-			int x2 = x+xoffs[offi], y2 = y+yoffs[offi];
-			if (x2<0 || x2>=canvas.width || y2<0 || y2>=canvas.height) continue;
-			
-			if (material_buffer(x,y) != material_buffer(x2,y2))
+			int x = 0;
+			for (; x+1<width; x+=2)
 			{
-				if (depth_buffer(x,y) > depth_buffer(x2,y2))
+				double2 depth = load2(d+x), material = load2(m+x);
+				mask2 edge =
+					((material != load2(m+x+1)) & (depth > load2(d+x+1))) |
+					((material != load2(m+x-1)) & (depth > load2(d+x-1))) |
+					((material != load2(m_down+x)) & (depth > load2(d_down+x))) |
+					((material != load2(m_up+x)) & (depth > load2(d_up+x)));
+				if (edge[0]) blacken(row[x]);
+				if (edge[1]) blacken(row[x+1]);
+			}
+			for (; x<width; x++)
+			{
+				if ((m[x] != m[x+1] && d[x] > d[x+1]) ||
+					(m[x] != m[x-1] && d[x] > d[x-1]) ||
+					(m[x] != m_down[x] && d[x] > d_down[x]) ||
+					(m[x] != m_up[x] && d[x] > d_up[x]))
 				{
-					change = true;
-					break;
+					blacken(row[x]);
 				}
 			}
 		}
-		
-		if (change)
+		else
 		{
-			canvas(x,y).r = 0;
-			canvas(x,y).g = 0;
-			canvas(x,y).b = 0;
+			for (int x=0; x<width; x++)
+			{
+				const int xoffs[4] = {1, -1, 0, 0};
+				const int yoffs[4] = {0, 0, 1, -1};
+				const double neighbours[4] = {d[x+1], d[x-1], d_down[x], d_up[x]};
+				
+				double diff = 0;
+				if (isfinite(d[x]))
+				{
+					Vec3 n = gbuffer(x,y).get_normal();
+					for (int offi=0; offi<4; offi++)
+					{
+						if (!isfinite(neighbours[offi])) continue;
+						double expected_depth =
+							d[x] -
+							xoffs[offi]*n.x/n.z -
+							yoffs[offi]*n.y/n.z;
+						if (expected_depth > neighbours[offi])
+							diff += expected_depth - neighbours[offi];
+					}
+				}
+				else
+				{
+					for (int offi=0; offi<4; offi++)
+						if (isfinite(neighbours[offi])) diff = INFINITY;
+				}
+				
+				if (diff != 0) darken(row[x], diff / 10);
+			}
 		}
 	}
 }
 
 
 
-Color light_fragment(
-	const Vec3& loc,
-	const Vec3& normal,
-	const Material& mat,
-	const list<SunLight>& lights)
+// Depth-tests one rasterized fragment of a face and, if it is visible, writes it straight into
+// the G-buffer. The G-buffer covers only part of the screen, with its corner at (x0,y0), and only
+// holds the samples that are taken, so it is packed step times tighter horizontally.
+template<typename Sample> struct FragmentWriter
 {
-	Color color;
-					
-	// Ambient lighting
-	color = color + mat.ambient;
+	Array2D<Sample> &gbuffer;
+	int x0, y0, step;
+	const TriangleSetup &triangle;
+	
+	FragmentWriter(
+		Array2D<Sample> &_gbuffer,
+		int _x0, int _y0, int _step,
+		const TriangleSetup &_triangle) :
+		gbuffer(_gbuffer),
+		x0(_x0), y0(_y0), step(_step),
+		triangle(_triangle)
+	{
+	}
 	
-	for (list<SunLight>::const_iterator it = lights.begin(); it != lights.end(); it++)
+	void operator()(int x, int y, const Vec3& affinities)
 	{
-		const SunLight &light = *it;
+		x = (x - x0) / step;
+		y -= y0;
 		
-		double bias = 0.2;
-		double alignment = (dot(light.direction, normal) + bias) / (1 + bias);
-		if (alignment > 0)
+		double depth = 
+			triangle.points[0].z * affinities.x +
+			triangle.points[1].z * affinities.y +
+			triangle.points[2].z * affinities.z;
+		Sample &sample = gbuffer(x,y);
+		
+		if (depth <= sample.get_depth())
 		{
-			// Make shading granular
-			
-			if (alignment < 0.6) alignment = 0.4;
-			else alignment = 0.8;
-			
-			// Diffuse lighting
-			color = color + alignment * mat.diffuse * light.color;
+			Vec3 normal =
+				triangle.normals[0]*affinities.x +
+				triangle.normals[1]*affinities.y +
+				triangle.normals[2]*affinities.z;
+			sample.set(depth, normal.normalize(), triangle.material);
+		}
+	}
+};
+
+// The same, at float precision
+template<typename Sample> struct FastFragmentWriter
+{
+	Array2D<Sample> &gbuffer;
+	int x0, y0, step;
+	const TriangleSetup &triangle;
+	
+	FastFragmentWriter(
+		Array2D<Sample> &_gbuffer,
+		int _x0, int _y0, int _step,
+		const TriangleSetup &_triangle) :
+		gbuffer(_gbuffer),
+		x0(_x0), y0(_y0), step(_step),
+		triangle(_triangle)
+	{
+	}
+	
+	void operator()(int x, int y, const Vec3& affinities)
+	{
+		x = (x - x0) / step;
+		y -= y0;
+		
+		Vec4f values = interpolate(triangle.attributes, affinities);
+		double depth = values.w();
+		Sample &sample = gbuffer(x,y);
+		
+		if (depth <= sample.get_depth())
+			sample.set(depth, normalize3(values), triangle.material);
+	}
+};
+
+// A sample of the first pass of ATTRIBUTES_DEFERRED: the depth of the nearest fragment so far (as
+// the G-buffer would store it), the face it belongs to, and its affinities for that face, from
+// which its normal is worked out in the second pass.
+struct DepthSample
+{
+	double depth;
+	Vec3 affinities;
+	const TriangleSetup *triangle;
+	
+	double get_depth() const { return depth; }
+};
+
+// Depth-tests fragments like FragmentWriter and FastFragmentWriter, but keeps only their depths
+// and where they are on their faces. Fast selects float precision.
+template<typename Sample, bool Fast> struct DepthWriter
+{
+	Array2D<DepthSample> &buffer;
+	int x0, y0, step;
+	const TriangleSetup &triangle;
+	
+	DepthWriter(
+		Array2D<DepthSample> &_buffer,
+		int _x0, int _y0, int _step,
+		const TriangleSetup &_triangle) :
+		buffer(_buffer),
+		x0(_x0), y0(_y0), step(_step),
+		triangle(_triangle)
+	{
+	}
+	
+	void operator()(int x, int y, const Vec3& affinities)
+	{
+		x = (x - x0) / step;
+		y -= y0;
+		
+		double depth;
+		if (Fast)
+		{
+			depth = interpolate(triangle.attributes, affinities).w();
+		}
+		else
+		{
+			depth =
+				triangle.points[0].z * affinities.x +
+				triangle.points[1].z * affinities.y +
+				triangle.points[2].z * affinities.z;
+		}
+		DepthSample &sample = buffer(x,y);
+		
+		if (depth <= sample.depth)
+		{
+			sample.depth = Sample::stored_depth(depth);
+			sample.affinities = affinities;
+			sample.triangle = &triangle;
+		}
+	}
+};
+
+// The second pass of ATTRIBUTES_DEFERRED: fills in the samples of a tile from the faces that won
+// them, with the normals interpolated just as the fragment writers would have
+template<typename Sample, bool Fast> void fill_attributes(
+	const Array2D<DepthSample>& depths,
+	Array2D<Sample>& tile)
+{
+	Sample empty;
+	empty.set(INFINITY, Vec3(0,0,0), no_material);
+	
+	for (int y=0; y<tile.height; y++)
+	{
+		const DepthSample *in = depths.row(y);
+		Sample *out = tile.row(y);
+		for (int x=0; x<tile.width; x++)
+		{
+			const TriangleSetup *triangle = in[x].triangle;
+			if (!triangle)
+			{
+				out[x] = empty;
+				continue;
+			}
 			
-			Vec3 reflection = (2 * alignment * normal - light.direction).normalize();
-			double eye_alignment = - dot(eye, reflection);
-			if (eye_alignment > 0)
+			const Vec3 &affinities = in[x].affinities;
+			Vec3 normal;
+			if (Fast)
+			{
+				normal = normalize3(interpolate(triangle->attributes, affinities));
+			}
+			else
 			{
-				// Specular lighting
-				color = color +
-					pow(eye_alignment, mat.shininess) *
-					mat.specular *
-					light.color;
+				normal = (
+					triangle->normals[0]*affinities.x +
+					triangle->normals[1]*affinities.y +
+					triangle->normals[2]*affinities.z).normalize();
 			}
+			out[x].set(in[x].depth, normal, triangle->material);
 		}
 	}
-		
-	return color;
 }
 
+// Size, in final pixels, of the square screen tiles that triangles are sorted into. Each tile
+// is rasterized at full supersampled resolution into a buffer of its own and resolved straight
+// away, so the supersampled image never exists in full. Tiles are independent, so they can be
+// worked on in parallel.
+const int tile_size = 16;
 
+// The finest sample grid render_core can resolve
+const int max_grid = 8;
 
-void supersample(
-	const Mesh& mesh,
-	const Matrix4& transform,
-	Array2D<double>& depth_buffer,
-	Array2D<Vec3>& normal_buffer,
-	Array2D<const Material*>& material_buffer,
-	int ssf,
-	CullMode cullmode)
+static const int grid_offsets[1] = {0};
+static const int rotated_grid_offsets[4] = {1, 3, 0, 2};
+static const int queens_offsets[8] = {0, 4, 7, 5, 2, 6, 1, 3};
+
+SampleLayout sample_layout(const RenderOptions& options)
+{
+	SampleLayout layout;
+	switch (options.samples)
+	{
+	case SAMPLES_ROTATED_GRID:
+		layout.grid = 4;
+		layout.step = 4;
+		layout.offsets = rotated_grid_offsets;
+		break;
+	case SAMPLES_QUEENS:
+		layout.grid = 8;
+		layout.step = 8;
+		layout.offsets = queens_offsets;
+		break;
+	case SAMPLES_GRID:
+	default:
+		layout.grid = min(max(options.supersampling, 1), max_grid);
+		layout.step = 1;
+		layout.offsets = grid_offsets;
+		break;
+	}
+	return layout;
+}
+
+// The supersampled G-buffer for one tile. Each thread keeps its own, which is reused for every
+// tile the thread draws.
+template<typename Sample> Array2D<Sample>& tile_gbuffer()
+{
+	static thread_local Array2D<Sample> gbuffer(0, 0);
+	return gbuffer;
+}
+
+// A tile's samples are split into square blocks of this many samples (of the tile's buffer) a
+// side, and the farthest depth in each is kept, so that faces behind everything drawn so far in
+// a block can be skipped without rasterizing them
+const int depth_block_size = 8;
+
+// The farthest depth of each block of a tile. Drawing only ever brings samples nearer, so a
+// bound that hasn't caught up with the latest drawing is still safe to test against, only loose.
+// Blocks that have been drawn to are marked stale, and brought up to date only when a face fails
+// the loose test.
+template<typename Sample> struct TileDepthBounds
+{
+	int blocks_x, blocks_y;
+	vector<double> far;
+	vector<uint8_t> stale;
+	
+	void reset(const Array2D<Sample>& tile)
+	{
+		blocks_x = (tile.width + depth_block_size - 1) / depth_block_size;
+		blocks_y = (tile.height + depth_block_size - 1) / depth_block_size;
+		far.assign(blocks_x*blocks_y, INFINITY);
+		stale.assign(blocks_x*blocks_y, 0);
+	}
+	
+	// Whether a face whose nearest depth in the block is nearest might be in front of any sample
+	bool visible(const Array2D<Sample>& tile, int bx, int by, double nearest)
+	{
+		int i = bx + by*blocks_x;
+		if (nearest <= far[i]) return true;
+		if (!stale[i]) return false;
+		
+		int x1 = bx*depth_block_size, x2 = min(x1 + depth_block_size, tile.width);
+		int y1 = by*depth_block_size, y2 = min(y1 + depth_block_size, tile.height);
+		double bound = -INFINITY;
+		for (int y=y1; y<y2 && bound != INFINITY; y++)
+		{
+			const Sample *row = tile.row(y);
+			for (int x=x1; x<x2; x++) bound = max(bound, row[x].get_depth());
+		}
+		far[i] = bound;
+		stale[i] = 0;
+		return nearest <= bound;
+	}
+};
+
+template<typename Sample> TileDepthBounds<Sample>& tile_depth_bounds()
+{
+	static thread_local TileDepthBounds<Sample> bounds;
+	return bounds;
+}
+
+// The nearest depth a face can have over a rectangle of the screen: the nearest of its vertices,
+// or nearer still where its plane comes nearer across the rectangle. It is pulled a little nearer
+// again to allow for rounding in the interpolated depths, so a face is never rejected where it
+// would have been drawn.
+struct DepthRange
 {
-	int width = depth_buffer.width, height = depth_buffer.height;
+	double nearest_vertex, margin;
+	double x0, y0, z0, dzdx, dzdy;
+	bool planar;
 	
-	Array2D<double> depth_ss_buffer(width*ssf, height*ssf);
-	Array2D<Vec3> normal_ss_buffer(width*ssf, height*ssf);
-	Array2D<const Material*> material_ss_buffer(width*ssf, height*ssf);
+	DepthRange(const TriangleSetup& t)
+	{
+		const Point3 &p0 = t.points[0], &p1 = t.points[1], &p2 = t.points[2];
+		nearest_vertex = min(p0.z, min(p1.z, p2.z));
+		margin = 1e-4 * (max(fabs(p0.z), max(fabs(p1.z), fabs(p2.z))) + 1);
+		
+		// Faces seen nearly edge-on have planes too steep to evaluate reliably
+		x0 = p0.x; y0 = p0.y; z0 = p0.z;
+		double ex1 = p1.x-p0.x, ey1 = p1.y-p0.y, ez1 = p1.z-p0.z;
+		double ex2 = p2.x-p0.x, ey2 = p2.y-p0.y, ez2 = p2.z-p0.z;
+		double det = ex1*ey2 - ey1*ex2;
+		dzdx = (ez1*ey2 - ez2*ey1) / det;
+		dzdy = (ez2*ex1 - ez1*ex2) / det;
+		planar = fabs(dzdx) < 1e3 && fabs(dzdy) < 1e3;
+	}
 	
-	Matrix4 transform2 = Matrix4::scaling(Vec3(ssf,ssf,ssf)) * transform;
-	render_core(mesh, transform2, depth_ss_buffer, normal_ss_buffer, material_ss_buffer, cullmode);
+	double nearest(double x1, double y1, double x2, double y2) const
+	{
+		double z = nearest_vertex;
+		if (planar)
+		{
+			double plane = z0 +
+				min(dzdx*(x1-x0), dzdx*(x2-x0)) +
+				min(dzdy*(y1-y0), dzdy*(y2-y0));
+			z = max(z, plane);
+		}
+		return z - margin;
+	}
+};
+
+template<typename Sample> struct TileContext
+{
+	const vector<TriangleSetup> *triangles;
+	const vector< vector<int> > *bins;
+	int tiles_x;
+	SampleLayout layout;
+	bool use_float;
+	AttributeFill attributes;
+	Array2D<Sample> *gbuffer;
+};
+
+// Downsamples a tile's supersampled G-buffer into the final one. Each pixel takes whichever
+// material covers the most of its samples (the first one found, on a tie), and averages the
+// depths and normals of just those samples.
+template<typename Sample> void resolve_tile(
+	Array2D<Sample>& tile,
+	const Viewport& region,
+	const SampleLayout& layout,
+	Array2D<Sample>& gbuffer)
+{
+	int grid = layout.grid, columns = layout.columns();
 	
-	depth_buffer.clear(INFINITY);
-	normal_buffer.clear(Vec3(0,0,0));
-	material_buffer.clear(NULL);
+	uint16_t found[max_grid*max_grid];
+	int counts[max_grid*max_grid];
 	
-	for (int x=0; x<width; x++) for (int y=0; y<height; y++)
+	for (int y=0; y<region.height; y++) for (int x=0; x<region.width; x++)
 	{
-		int best_count = 0;
-		for (int xo=0; xo<ssf; xo++) for (int yo=0; yo<ssf; yo++)
+		// Count the samples of each material. A pixel rarely holds more than two or three
+		// materials, so this is about one pass over its samples.
+		int num_found = 0;
+		for (int xo=0; xo<columns; xo++) for (int yo=0; yo<grid; yo++)
 		{
-			const Material* this_material = material_ss_buffer(x*ssf+xo,y*ssf+yo);
-			int count = 0;
-			for (int xo2=0; xo2<ssf; xo2++) for (int yo2=0; yo2<ssf; yo2++)
-				if (this_material == material_ss_buffer(x*ssf+xo2,y*ssf+yo2)) count++;
-			if (count > best_count)
+			uint16_t this_material = tile(x*columns+xo, y*grid+yo).material;
+			int i = 0;
+			while (i < num_found && found[i] != this_material) i++;
+			if (i == num_found)
 			{
-				material_buffer(x,y) = this_material;
-				best_count = count;
+				found[i] = this_material;
+				counts[i] = 0;
+				num_found++;
 			}
+			counts[i]++;
 		}
 		
-		if (material_buffer(x,y))
+		int best = 0;
+		for (int i=1; i<num_found; i++) if (counts[i] > counts[best]) best = i;
+		uint16_t material = found[best];
+		int best_count = counts[best];
+		
+		Sample &pixel = gbuffer(region.x + x, region.y + y);
+		if (material == no_material)
 		{
-			depth_buffer(x,y) = 0;
-			normal_buffer(x,y) = Vec3(0,0,0);
-			for (int xo=0; xo<ssf; xo++) for (int yo=0; yo<ssf; yo++)
+			pixel.set(INFINITY, Vec3(0,0,0), no_material);
+			continue;
+		}
+		
+		double depth = 0;
+		Vec3 normal(0,0,0);
+		for (int xo=0; xo<columns; xo++) for (int yo=0; yo<grid; yo++)
+		{
+			const Sample &sample = tile(x*columns+xo, y*grid+yo);
+			if (sample.material == material)
 			{
-				if (material_ss_buffer(x*ssf+xo, y*ssf+yo) == material_buffer(x,y))
+				depth += sample.get_depth() / grid;
+				normal = normal + sample.get_normal();
+			}
+		}
+		pixel.set(depth / best_count, normal.normalize(), material);
+	}
+}
+
+// Draws the faces binned into one tile into a buffer of its samples, with a Writer for each face.
+// Every tile draws its faces in the order they were binned, so the result does not depend on how
+// tiles are spread across threads. Rows of blocks where a face is behind everything already drawn
+// are skipped.
+template<typename Writer, typename Sample, typename Target> void draw_tile(
+	const TileContext<Sample>& context,
+	int tile,
+	const Viewport& clip,
+	Array2D<Target>& buffer)
+{
+	const SampleLayout &layout = context.layout;
+	int step = layout.step;
+	
+	TileDepthBounds<Target> &bounds = tile_depth_bounds<Target>();
+	bounds.reset(buffer);
+	
+	const vector<int> &bin = (*context.bins)[tile];
+	for (vector<int>::const_iterator it = bin.begin(); it != bin.end(); it++)
+	{
+		const TriangleSetup &triangle = (*context.triangles)[*it];
+		
+		// The part of the tile's buffer the face's bounding box covers
+		int c1 = max(triangle.x1 - clip.x, 0) / step;
+		int c2 = min(triangle.x2 - clip.x, clip.width-1) / step;
+		int r1 = max(triangle.y1 - clip.y, 0);
+		int r2 = min(triangle.y2 - clip.y, clip.height-1);
+		if (c1 > c2 || r1 > r2) continue;
+		int bx1 = c1 / depth_block_size, bx2 = c2 / depth_block_size;
+		int by1 = r1 / depth_block_size, by2 = r2 / depth_block_size;
+		
+		// Rasterize the runs of block rows where the face might be visible. Only rows are
+		// skipped, not columns, so every row that is drawn starts from the same point as it
+		// would without skipping, and gets exactly the same affinities.
+		DepthRange depths(triangle);
+		int run_start = -1;
+		for (int by=by1; by<=by2+1; by++)
+		{
+			bool visible = false;
+			if (by <= by2)
+			{
+				double y1 = clip.y + max(by*depth_block_size, r1);
+				double y2 = clip.y + min(by*depth_block_size + depth_block_size-1, r2);
+				for (int bx=bx1; bx<=bx2 && !visible; bx++)
 				{
-					depth_buffer(x,y) += depth_ss_buffer(x*ssf+xo, y*ssf+yo) / ssf;
-					normal_buffer(x,y) = normal_buffer(x,y) + normal_ss_buffer(x*ssf+xo, y*ssf+yo);
+					double x1 = clip.x + max(bx*depth_block_size, c1)*step;
+					double x2 = clip.x + (min(bx*depth_block_size + depth_block_size-1, c2)+1)*step - 1;
+					visible = bounds.visible(buffer, bx, by, depths.nearest(x1, y1, x2, y2));
 				}
 			}
-			depth_buffer(x,y) /= best_count;
-			normal_buffer(x,y) = normal_buffer(x,y).normalize();
+			
+			if (visible && run_start < 0) run_start = by;
+			if (visible || run_start < 0) continue;
+			
+			int y1 = max(run_start*depth_block_size, r1), y2 = min(by*depth_block_size-1, r2);
+			Viewport rows(clip.x, clip.y + y1, clip.width, y2 - y1 + 1);
+			Writer writer(buffer, clip.x, clip.y, step, triangle);
+			rasterize_triangle(triangle, rows, layout, writer);
+			
+			for (int sy=run_start; sy<by; sy++) for (int bx=bx1; bx<=bx2; bx++)
+				bounds.stale[bx + sy*bounds.blocks_x] = 1;
+			run_start = -1;
 		}
 	}
 }
 
+// Draws one tile into this thread's tile buffers, then resolves it into the final G-buffer
+template<typename Sample> void rasterize_tile(int tile, void* _context)
+{
+	TileContext<Sample> &context = *(TileContext<Sample>*)_context;
+	const SampleLayout &layout = context.layout;
+	int grid = layout.grid;
+	
+	int width = context.gbuffer->width, height = context.gbuffer->height;
+	int tx = tile % context.tiles_x, ty = tile / context.tiles_x;
+	Viewport region(
+		tx*tile_size, ty*tile_size,
+		min(tile_size, width - tx*tile_size), min(tile_size, height - ty*tile_size));
+	Viewport clip(region.x*grid, region.y*grid, region.width*grid, region.height*grid);
+	
+	Array2D<Sample> &tile_samples = tile_gbuffer<Sample>();
+	tile_samples.resize(region.width*layout.columns(), clip.height);
+	
+	if (context.attributes == ATTRIBUTES_DEFERRED)
+	{
+		Array2D<DepthSample> &depths = tile_gbuffer<DepthSample>();
+		depths.resize(tile_samples.width, tile_samples.height);
+		DepthSample empty;
+		empty.depth = INFINITY;
+		empty.triangle = NULL;
+		depths.fill(empty);
+		
+		if (context.use_float)
+		{
+			draw_tile< DepthWriter<Sample, true> >(context, tile, clip, depths);
+			fill_attributes<Sample, true>(depths, tile_samples);
+		}
+		else
+		{
+			draw_tile< DepthWriter<Sample, false> >(context, tile, clip, depths);
+			fill_attributes<Sample, false>(depths, tile_samples);
+		}
+	}
+	else
+	{
+		Sample empty;
+		empty.set(INFINITY, Vec3(0,0,0), no_material);
+		tile_samples.fill(empty);
+		
+		if (context.use_float)
+			draw_tile< FastFragmentWriter<Sample> >(context, tile, clip, tile_samples);
+		else
+			draw_tile< FragmentWriter<Sample> >(context, tile, clip, tile_samples);
+	}
+	
+	resolve_tile(tile_samples, region, layout, *context.gbuffer);
+}
 
+// Where a box of the mesh lands on a screen of samples
+enum BoxVisibility { BOX_OUTSIDE, BOX_PARTLY_INSIDE, BOX_INSIDE };
+
+static BoxVisibility box_visibility(const BVHNode& node, const Matrix4& transform, int width, int height)
+{
+	const double (&e)[4][4] = transform.e;
+	double x1, y1, x2, y2;
+	if (Matrix4f::is_affine(transform))
+	{
+		// The box's center lands at the center of its screen box, which reaches as far from it as
+		// the half extents, transformed, can add up to
+		double cx = (node.min.x + node.max.x) / 2, hx = (node.max.x - node.min.x) / 2;
+		double cy = (node.min.y + node.max.y) / 2, hy = (node.max.y - node.min.y) / 2;
+		double cz = (node.min.z + node.max.z) / 2, hz = (node.max.z - node.min.z) / 2;
+		double sx = e[0][0]*cx + e[1][0]*cy + e[2][0]*cz + e[3][0];
+		double sy = e[0][1]*cx + e[1][1]*cy + e[2][1]*cz + e[3][1];
+		double rx = fabs(e[0][0])*hx + fabs(e[1][0])*hy + fabs(e[2][0])*hz;
+		double ry = fabs(e[0][1])*hx + fabs(e[1][1])*hy + fabs(e[2][1])*hz;
+		x1 = sx - rx; x2 = sx + rx;
+		y1 = sy - ry; y2 = sy + ry;
+	}
+	else
+	{
+		x1 = INFINITY; y1 = INFINITY; x2 = -INFINITY; y2 = -INFINITY;
+		for (int i=0; i<8; i++)
+		{
+			Point3 corner(
+				i & 1 ? node.max.x : node.min.x,
+				i & 2 ? node.max.y : node.min.y,
+				i & 4 ? node.max.z : node.min.z);
+			
+			// A corner behind the eye (or at infinity) could land anywhere
+			double w = e[0][3]*corner.x + e[1][3]*corner.y + e[2][3]*corner.z + e[3][3];
+			if (!(w > 0)) return BOX_PARTLY_INSIDE;
+			
+			Point3 p = transform * corner;
+			x1 = min(x1, p.x); x2 = max(x2, p.x);
+			y1 = min(y1, p.y); y2 = max(y2, p.y);
+		}
+	}
+	
+	// Samples are at whole coordinates from 0 to width-1 and height-1. The boxes are widened by a
+	// sample, to allow for the vertices being transformed at float precision.
+	if (x2 < -1 || x1 > width || y2 < -1 || y1 > height) return BOX_OUTSIDE;
+	if (x1 >= 0 && x2 <= width-1 && y1 >= 0 && y2 <= height-1) return BOX_INSIDE;
+	return BOX_PARTLY_INSIDE;
+}
 
-void render_core(
+// Flags the faces whose boxes in the mesh's bounding volume hierarchy overlap the screen, skipping
+// whole subtrees that are outside it. Returns false, without flagging anything, if no faces can
+// be skipped (everything is on screen, or the mesh has no hierarchy).
+static bool cull_faces(
 	const Mesh& mesh,
 	const Matrix4& transform,
-	Array2D<double> &depth_buffer,
-	Array2D<Vec3> &normal_buffer,
-	Array2D<const Material*> &material_buffer,
-	CullMode cullmode)
+	int width, int height,
+	vector<uint8_t>& face_flags)
 {
-	int width = depth_buffer.width, height = depth_buffer.height;
+	if (mesh.bvh.empty() || mesh.bvh_faces.size() != (size_t)mesh.num_faces()) return false;
+	if (box_visibility(mesh.bvh[0], transform, width, height) == BOX_INSIDE) return false;
+	
+	face_flags.assign(mesh.num_faces(), 0);
+	vector<uint32_t> stack(1, 0);
+	while (!stack.empty())
+	{
+		const BVHNode &node = mesh.bvh[stack.back()];
+		stack.pop_back();
 		
-	depth_buffer.clear(INFINITY);
-	normal_buffer.clear(Vec3(0,0,0));
-	material_buffer.clear(NULL);
+		BoxVisibility visibility = box_visibility(node, transform, width, height);
+		if (visibility == BOX_OUTSIDE) continue;
 		
-	for (list<Face>::const_iterator it = mesh.faces.begin(); it != mesh.faces.end(); it++)
+		if (visibility == BOX_INSIDE || !node.children)
+		{
+			for (uint32_t i=0; i<node.count; i++) face_flags[mesh.bvh_faces[node.first + i]] = 1;
+		}
+		else
+		{
+			stack.push_back(node.children);
+			stack.push_back(node.children + 1);
+		}
+	}
+	return true;
+}
+
+static inline SnappedVertex snap_vertex(double x, double y)
+{
+	SnappedVertex v;
+	v.usable = fabs(x) < guard_band && fabs(y) < guard_band;
+	v.x = v.usable ? llround(x*subpixel_one) : 0;
+	v.y = v.usable ? llround(y*subpixel_one) : 0;
+	return v;
+}
+
+// The triangle setup stage. Goes through the mesh's faces in order (only the flagged ones, if
+// there are flags), drops every face that can't draw anything, and sets up the rest, in one pass
+// over the transformed and snapped vertices. Faces are dropped if they touch a vertex outside the
+// guard band, are culled by cullmode, have no area once snapped, or have no sample inside their
+// bounds on screen, which takes care of both sub-pixel faces and faces off the screen.
+static void setup_triangles(
+	const Mesh& mesh,
+	RenderScratch& scratch,
+	bool use_float,
+	const vector<uint8_t>* face_flags,
+	CullMode cullmode,
+	int width, int height)
+{
+	vector<TriangleSetup> &triangles = scratch.triangles;
+	triangles.clear();
+	
+	for (int f=0; f<mesh.num_faces(); f++)
 	{
-		const Face &face = *it;
+		if (face_flags && !(*face_flags)[f]) continue;
+		const uint32_t *face = &mesh.indices[f*3];
 		
-		// if (face.material.ambient.r<face.material.ambient.b+0.2) continue;
-		
-		const Vertex &p1 = face.vertices[0];
-		const Vertex &p2 = face.vertices[1];
-		const Vertex &p3 = face.vertices[2];
-				
-		Point3 p1_t = transform * p1.point;
-		Point3 p2_t = transform * p2.point;
-		Point3 p3_t = transform * p3.point;
+		const SnappedVertex &s0 = scratch.snapped[face[0]];
+		const SnappedVertex &s1 = scratch.snapped[face[1]];
+		const SnappedVertex &s2 = scratch.snapped[face[2]];
+		if (!(s0.usable && s1.usable && s2.usable)) continue;
+		int64_t vx[3] = {s0.x, s1.x, s2.x}, vy[3] = {s0.y, s1.y, s2.y};
 		
-		/* Back-face culling */
-		switch(cullmode)
+		TriangleSetup t;
+		if (use_float)
 		{
-		case CULL_FRONT:
-			if (dot(cross(p2_t-p1_t, p3_t-p1_t), eye)>0) continue;
-			break;
-		case CULL_BACK:
-			if (dot(cross(p2_t-p1_t, p3_t-p1_t), eye)<0) continue;
-			break;
-		case CULL_NONE: break;
+			for (int i=0; i<3; i++)
+			{
+				const Vec4f &p = scratch.positions_f[face[i]];
+				t.points[i] = Point3(p.x(), p.y(), p.z());
+			}
 		}
-				
-		Vec3 n1 = p1.normal;
-		if (dot(eye, transform*n1)<0) n1 = -n1;
-		Vec3 n2 = p2.normal;
-		if (dot(eye, transform*n2)<0) n2 = -n2;
-		Vec3 n3 = p3.normal;
-		if (dot(eye, transform*n3)<0) n3 = -n3;
-		
-		vector< pair<Point2,Vec3> > raster_pixels = rasterize_triangle(p1_t, p2_t, p3_t);
-		
-		for (vector< pair<Point2,Vec3> >::iterator it = raster_pixels.begin();
-			it != raster_pixels.end();
-			it++)
-		{
-			Point2 location = (*it).first;
-			int x = location.x, y = location.y;
-			Vec3 affinities = (*it).second;
-			
-			// Skip pixels outside of the canvas
-			if (x<0 || y<0 || x>=width || y>=height) continue;
+		else
+		{
+			for (int i=0; i<3; i++) t.points[i] = scratch.positions[face[i]];
+		}
+		
+		// Back-face culling, by the facing of the unsnapped face
+		const Point3 &p1 = t.points[0], &p2 = t.points[1], &p3 = t.points[2];
+		double facing = (p1.x-p2.x)*(p1.y-p3.y) - (p1.x-p3.x)*(p1.y-p2.y);
+		if (cullmode == CULL_FRONT && facing > 0) continue;
+		if (cullmode == CULL_BACK && facing < 0) continue;
+		
+		// Edge i is the edge opposite vertex i. Its function is zero along the edge and, for a
+		// counterclockwise triangle, positive on the side of vertex i. Zero-area triangles
+		// (including ones with shared points) cover nothing.
+		int64_t area =
+			(vx[1]-vx[0]) * (vy[2]-vy[0]) -
+			(vy[1]-vy[0]) * (vx[2]-vx[0]);
+		if (area == 0) continue;
+		
+		// The samples inside the bounds, clipped to the screen
+		int64_t min_vx = min(vx[0], min(vx[1], vx[2])), max_vx = max(vx[0], max(vx[1], vx[2]));
+		int64_t min_vy = min(vy[0], min(vy[1], vy[2])), max_vy = max(vy[0], max(vy[1], vy[2]));
+		t.x1 = max((min_vx + subpixel_one - 1) >> subpixel_bits, (int64_t)0);
+		t.y1 = max((min_vy + subpixel_one - 1) >> subpixel_bits, (int64_t)0);
+		t.x2 = min(max_vx >> subpixel_bits, (int64_t)width-1);
+		t.y2 = min(max_vy >> subpixel_bits, (int64_t)height-1);
+		if (t.x1 > t.x2 || t.y1 > t.y2) continue;
+		
+		// Walk clockwise triangles backwards, so every edge function is positive inside
+		t.order[0] = 0; t.order[1] = 1; t.order[2] = 2;
+		if (area < 0) { t.order[1] = 2; t.order[2] = 1; area = -area; }
+		t.inv_area = 1.0 / area;
+		
+		for (int i=0; i<3; i++)
+		{
+			int from = t.order[(i+1)%3], to = t.order[(i+2)%3];
+			int64_t dx = vx[to]-vx[from], dy = vy[to]-vy[from];
 			
-			double depth = 
-				p1_t.z * affinities.x +
-				p2_t.z * affinities.y +
-				p3_t.z * affinities.z;
-			double pdepth = depth_buffer(x,y);
+			t.a[i] = -dy;
+			t.b[i] = dx;
+			t.c[i] = dy*vx[from] - dx*vy[from];
 			
-			if (depth <= pdepth)
+			// Top-left fill rule: a sample exactly on an edge belongs to the triangle only if the
+			// edge is a left edge or a horizontal top edge
+			bool top_left = dy < 0 || (dy == 0 && dx > 0);
+			t.bias[i] = top_left ? 0 : -1;
+		}
+		
+		if (use_float)
+		{
+			for (int i=0; i<3; i++)
 			{
-				depth_buffer(x,y) = depth;
-				
-				Vec3 normal = n1*affinities.x + n2*affinities.y + n3*affinities.z;
-				normal_buffer(x,y) = (transform * normal).normalize();
-				
-				material_buffer(x,y) = face.material;
+				const Vec4f &n = scratch.normals_f[face[i]];
+				t.attributes[i] = Vec4f(n.x(), n.y(), n.z(), t.points[i].z);
 			}
 		}
+		else
+		{
+			for (int i=0; i<3; i++) t.normals[i] = scratch.normals[face[i]];
+		}
+		
+		t.material = mesh.face_materials[f];
+		
+		triangles.push_back(t);
 	}
 }
 
-vector< pair<Point2,Vec3> > rasterize_triangle(Point2 p1, Point2 p2, Point2 p3)
+// How far, at most, the transform moves a point on screen for every unit it moves in the mesh, or
+// infinity for a projective transform, which has no one bound
+static double screen_scale(const Matrix4& transform)
 {
-	vector< pair<Point2,Vec3> > pixels;
+	if (!Matrix4f::is_affine(transform)) return INFINITY;
+	
+	const double (&e)[4][4] = transform.e;
+	double sum = 0;
+	for (int i=0; i<3; i++) sum += e[i][0]*e[i][0] + e[i][1]*e[i][1];
+	return sqrt(sum);
+}
 
-	// Bail out early if any points are shared, because this messes up the algorithm later on.
-	if (p1==p2 || p2==p3 || p1==p3) return pixels;
-		
-	// Sort the points by Y
-	Point2 p1_s = p1, p2_s = p2, p3_s = p3, temp;
-	if (p1_s.y > p2_s.y) { temp = p1_s; p1_s = p2_s; p2_s = temp; }
-	if (p2_s.y > p3_s.y) { temp = p2_s; p2_s = p3_s; p3_s = temp; }
-	if (p1_s.y > p2_s.y) { temp = p1_s; p1_s = p2_s; p2_s = temp; }
+// Renders the mesh (or one of its levels of detail) into a G-buffer, which must already be sized,
+// supersampled as the options ask.
+template<typename Sample> void render_core(
+	const Mesh& full_mesh,
+	const Matrix4& transform,
+	Array2D<Sample>& gbuffer,
+	RenderScratch& scratch,
+	const RenderOptions& options)
+{
+	SampleLayout layout = sample_layout(options);
+	int grid = layout.grid;
+	
+	int width = gbuffer.width, height = gbuffer.height;
+	int ss_width = width*grid, ss_height = height*grid;
+	
+	Matrix4 ss_transform = Matrix4::scaling(Vec3(grid,grid,grid)) * transform;
+	
+	// Floats only handle affine transforms, so anything else is drawn at double precision
+	bool use_float = options.precision == PRECISION_FLOAT && Matrix4f::is_affine(ss_transform);
 	
-	int min_y = round(p1_s.y);
-	int max_y = round(p3_s.y);
+	// A level of detail shares the mesh's materials, so the rest of the render can't tell which
+	// one was drawn
+	const Mesh &mesh = options.detail == DETAIL_AUTO ?
+		full_mesh.level_of_detail(0.5 / screen_scale(ss_transform)) : full_mesh;
 	
-	// Allocate tables to hold minimum and maximum x-coordinates
-	double *mins = new double[max_y+1-min_y];
-	double *maxes = new double[max_y+1-min_y];
-	for (int y=min_y; y<=max_y; y++)
+	// Skip the parts of the mesh that are off screen, if any
+	vector<uint8_t> &face_flags = scratch.face_flags;
+	vector<uint8_t> &vertex_flags = scratch.vertex_flags;
+	bool culled = cull_faces(mesh, ss_transform, ss_width, ss_height, face_flags);
+	if (culled)
 	{
-		mins[y-min_y] = INFINITY;
-		maxes[y-min_y] = -INFINITY;
+		vertex_flags.assign(mesh.positions.size(), 0);
+		for (int f=0; f<mesh.num_faces(); f++)
+		{
+			if (!face_flags[f]) continue;
+			for (int i=0; i<3; i++) vertex_flags[mesh.indices[f*3+i]] = 1;
+		}
 	}
-		
-	// For each edge of the triangle, fill out the minimum and maximum x-coordinates
-	for (int i=0; i<3; i++)
+	
+	// Transform every vertex (that is used) once, and snap it for the rasterizer. Normals are
+	// flipped to face the eye, so that both sides of a face are lit the same.
+	vector<Point3> &positions = scratch.positions;
+	vector<Vec3> &normals = scratch.normals;
+	vector<Vec4f> &positions_f = scratch.positions_f;
+	vector<Vec4f> &normals_f = scratch.normals_f;
+	vector<SnappedVertex> &snapped = scratch.snapped;
+	if (use_float)
 	{
-		// Set a and b to the two end points of this edge
-		Point2 a = i==0 ? p1_s : i==1 ? p2_s : p1_s;
-		Point2 b = i==0 ? p2_s : i==1 ? p3_s : p3_s;
-				
-		// Skip the case where the y-coordinates are the same, because this messes the algorithm
-		// up, and is meaningless anyway
-		if (round(a.y) == round(b.y)) continue;
-		
-		double slope = (round(b.x) - round(a.x)) / (round(b.y) - round(a.y));
+		Matrix4f ss_transform_f(ss_transform);
+		positions_f.resize(mesh.positions.size());
+		normals_f.resize(mesh.normals.size());
+		if (culled)
+		{
+			for (unsigned int i=0; i<positions_f.size(); i++)
+			{
+				if (!vertex_flags[i]) continue;
+				positions_f[i] = transform_point(ss_transform_f, mesh.positions[i]);
+				normals_f[i] = transform_vector(ss_transform_f, mesh.normals[i]);
+			}
+		}
+		else
+		{
+			transform_points(ss_transform_f, mesh.positions.data(), positions_f.data(), positions_f.size());
+			transform_vectors(ss_transform_f, mesh.normals.data(), normals_f.data(), normals_f.size());
+		}
+		for (unsigned int i=0; i<normals_f.size(); i++)
+			if (normals_f[i].z() < 0) normals_f[i] = -normals_f[i];
 		
-		for (int y = round(a.y); y <= round(b.y); y++)
-		{			
-			double x = round(a.x) + slope * (y - round(a.y));
-			if (x < mins[y-min_y]) mins[y-min_y] = x;
-			if (x > maxes[y-min_y]) maxes[y-min_y] = x;
+		snapped.resize(positions_f.size());
+		for (unsigned int i=0; i<positions_f.size(); i++)
+			if (!culled || vertex_flags[i]) snapped[i] = snap_vertex(positions_f[i].x(), positions_f[i].y());
+	}
+	else
+	{
+		positions.resize(mesh.positions.size());
+		normals.resize(mesh.normals.size());
+		snapped.resize(positions.size());
+		for (unsigned int i=0; i<positions.size(); i++)
+		{
+			if (culled && !vertex_flags[i]) continue;
+			positions[i] = ss_transform * mesh.positions[i];
+			normals[i] = ss_transform * mesh.normals[i];
+			if (dot(eye, normals[i])<0) normals[i] = -normals[i];
+			snapped[i] = snap_vertex(positions[i].x, positions[i].y);
 		}
 	}
 	
-	// Generate the actual points
-	for (int y=min_y; y<=max_y; y++)
+	// Set up the faces that might draw anything
+	setup_triangles(mesh, scratch, use_float, culled ? &face_flags : NULL, options.cullmode, ss_width, ss_height);
+	vector<TriangleSetup> &triangles = scratch.triangles;
+	
+	// Faces are drawn in mesh order, or nearest first (by the depth of their centroids) so that
+	// faces behind them can be rejected early. Ties keep mesh order.
+	vector< pair<double, int> > &draw_order = scratch.draw_order;
+	draw_order.resize(triangles.size());
+	for (unsigned int i=0; i<triangles.size(); i++)
+	{
+		const TriangleSetup &t = triangles[i];
+		double centroid = options.order == ORDER_FRONT_TO_BACK ?
+			(t.points[0].z + t.points[1].z + t.points[2].z) / 3 : 0;
+		draw_order[i] = pair<double, int>(centroid, i);
+	}
+	if (options.order == ORDER_FRONT_TO_BACK) sort(draw_order.begin(), draw_order.end());
+	
+	// Sort the triangles into the tiles they overlap
+	int tiles_x = (width + tile_size - 1) / tile_size;
+	int tiles_y = (height + tile_size - 1) / tile_size;
+	int ss_tile_size = tile_size*grid;
+	vector< vector<int> > &bins = scratch.bins;
+	bins.resize(tiles_x * tiles_y);
+	for (unsigned int i=0; i<bins.size(); i++) bins[i].clear();
+	
+	for (unsigned int j=0; j<draw_order.size(); j++)
+	{
+		int i = draw_order[j].second;
+		const TriangleSetup &t = triangles[i];
+		for (int ty = t.y1/ss_tile_size; ty <= t.y2/ss_tile_size; ty++)
+			for (int tx = t.x1/ss_tile_size; tx <= t.x2/ss_tile_size; tx++)
+				bins[tx + ty*tiles_x].push_back(i);
+	}
+	
+	TileContext<Sample> context;
+	context.triangles = &triangles;
+	context.bins = &bins;
+	context.tiles_x = tiles_x;
+	context.layout = layout;
+	context.use_float = use_float;
+	context.attributes = options.attributes;
+	context.gbuffer = &gbuffer;
+	
+	if (options.pool) options.pool->run(tiles_x * tiles_y, rasterize_tile<Sample>, &context);
+	else for (int i=0; i<tiles_x*tiles_y; i++) rasterize_tile<Sample>(i, &context);
+}
+
+// Calls visit(x, y, affinities) for every pixel of the triangle that lies inside the clipping
+// rectangle and is one of the layout's samples. Pixel (x,y) is sampled at the point (x,y).
+// 
+// This is a half-space rasterizer: a pixel is covered if it lies on the inner side of all three
+// edges. The edge functions are integers, set up by setup_triangles() and stepped from pixel to
+// pixel with additions only, and the top-left fill rule decides ownership of pixels that lie
+// exactly on an edge, so a pixel on an edge shared by two triangles is only drawn once. The
+// affinities (barycentric coordinates) are stepped with additions as well, and are re-anchored to
+// the exact edge functions at the start of every row.
+template<typename Visitor> void rasterize_triangle(
+	const TriangleSetup& triangle,
+	const Viewport& clip,
+	const SampleLayout& layout,
+	Visitor& visit)
+{
+	const int64_t *a = triangle.a, *b = triangle.b, *c = triangle.c, *bias = triangle.bias;
+	const int *order = triangle.order;
+	
+	// The triangle's samples, clipped to the clipping rectangle
+	int x1 = max(triangle.x1, clip.x), x2 = min(triangle.x2, clip.x+clip.width-1);
+	int y1 = max(triangle.y1, clip.y), y2 = min(triangle.y2, clip.y+clip.height-1);
+	if (x1 > x2 || y1 > y2) return;
+	
+	// Affinity of the vertex opposite each edge, and how it changes per pixel
+	// Only every step'th pixel of a row is a sample, so that is how far x moves.
+	double inv_area = triangle.inv_area;
+	int step = layout.step;
+	int64_t edge_step_x[3], edge_step_y[3];
+	double step_x[3];
+	for (int i=0; i<3; i++)
+	{
+		edge_step_x[i] = a[i]*subpixel_one*step;
+		edge_step_y[i] = b[i]*subpixel_one;
+		step_x[i] = edge_step_x[i] * inv_area;
+	}
+	
+	int64_t row[3];
+	for (int i=0; i<3; i++) row[i] = (a[i]*x1 + b[i]*y1)*subpixel_one + c[i];
+	
+	for (int y=y1; y<=y2; y++)
 	{
-		for (int x=round(mins[y-min_y]); x<=round(maxes[y-min_y]); x++)
+		// First sample of the row at or after x1
+		int dx = ((layout.offsets[y % step] - x1) % step + step) % step;
+		int64_t e0 = row[0] + a[0]*dx*subpixel_one;
+		int64_t e1 = row[1] + a[1]*dx*subpixel_one;
+		int64_t e2 = row[2] + a[2]*dx*subpixel_one;
+		double l[3] = {e0*inv_area, e1*inv_area, e2*inv_area};
+		
+		for (int x=x1+dx; x<=x2; x+=step)
 		{
-			Point2 p(x,y);
-			
-			double p2x = cross(p-p1, p3-p1) / cross(p2-p1, p3-p1);
-			double p3x = cross(p-p1, p2-p1) / cross(p3-p1, p2-p1);
-			
-			/* Because coordinates are rounded to the nearest integer, sometimes the algorithm
-			generates a pixel that is actually outside of the triangle it is supposedly a part of.
-			This is okay, because the pixel will be right on the edge of the triangle in question.
-			The problem is that if the triangle is very small, the error in the pixel's location may
-			be many times the length of the sides of the triangle, leading to values for p1x, p2x,
-			and p3x that are far out of bounds. This causes all sorts of artifacts in the final
-			images. To solve the problem, we clamp the values for p1x, p2x, and p3x to within the
-			expected ranges. */
-			
-			if (p2x<0) p2x=0;
-			if (p2x>1) p2x=1;
-			if (p3x<0) p3x=0;
-			if (p3x>1) p3x=1;
-			
-			double p1x = 1.0 - p2x - p3x;
-			
-			if (p1x<0) { p2x += p1x/2; p3x += p1x/2; p1x=0; }
+			if (e0+bias[0] >= 0 && e1+bias[1] >= 0 && e2+bias[2] >= 0)
+			{
+				double affinities[3];
+				affinities[order[0]] = l[0];
+				affinities[order[1]] = l[1];
+				affinities[order[2]] = l[2];
+				visit(x, y, Vec3(affinities[0], affinities[1], affinities[2]));
+			}
 			
-			pixels.push_back(pair<Point2,Vec3>(p, Vec3(p1x, p2x, p3x)));
+			e0 += edge_step_x[0];
+			e1 += edge_step_x[1];
+			e2 += edge_step_x[2];
+			l[0] += step_x[0];
+			l[1] += step_x[1];
+			l[2] += step_x[2];
 		}
+		
+		row[0] += edge_step_y[0];
+		row[1] += edge_step_y[1];
+		row[2] += edge_step_y[2];
 	}
-	
-	return pixels;
 }
 
 /*
@@ -2,6 +2,8 @@
 #include "Image.h"
 #include "Mesh.h"
 
+#include <vector>
+
 
 
 
@@ -17,12 +19,183 @@ enum CullMode
 	CULL_NONE
 };
 
+// Where each pixel is sampled. SAMPLES_GRID takes supersampling*supersampling samples in a
+// regular grid. The others are sparse patterns that take one sample per row and column of a finer
+// grid: SAMPLES_ROTATED_GRID takes 4 samples (on a 4x4 grid), and SAMPLES_QUEENS takes 8 (on an
+// 8x8 grid, placed like queens that can't attack each other).
+enum SamplePattern
+{
+	SAMPLES_GRID,
+	SAMPLES_ROTATED_GRID,
+	SAMPLES_QUEENS
+};
+
+// How the G-buffer (the depth, normal and material of every sample, before lighting) is stored.
+// GBUFFER_FULL keeps doubles. GBUFFER_PACKED takes 12 bytes a sample instead of 40, with a float
+// depth and 16-bit normals, which is faster but not bit-identical.
+enum GBufferFormat
+{
+	GBUFFER_FULL,
+	GBUFFER_PACKED
+};
+
+// The precision that vertices are transformed and fragments interpolated at. PRECISION_FLOAT is
+// faster. PRECISION_DOUBLE is the reference, for checking the float path's output against.
+enum Precision
+{
+	PRECISION_FLOAT,
+	PRECISION_DOUBLE
+};
+
+// How fragments are lit. SHADING_EXACT evaluates the lighting for every pixel. SHADING_TABLE
+// looks it up by normal in a table kept for each material and set of lights, and matches
+// SHADING_EXACT to within one 8-bit step.
+enum ShadingMode
+{
+	SHADING_EXACT,
+	SHADING_TABLE
+};
+
+// Which edges are drawn over the shaded image. OUTLINE_MATERIAL blacks out the edges between
+// materials. OUTLINE_DISCONTINUITY darkens edges by how sharply the depth changes across them.
+enum OutlineStyle
+{
+	OUTLINE_MATERIAL,
+	OUTLINE_DISCONTINUITY,
+	OUTLINE_NONE
+};
+
+// The order faces are drawn in. ORDER_MESH draws them as the mesh lists them. ORDER_FRONT_TO_BACK
+// draws the nearest first, so that the faces behind them can be skipped early; the image only
+// differs where faces overlap at exactly the same depth.
+enum FaceOrder
+{
+	ORDER_MESH,
+	ORDER_FRONT_TO_BACK
+};
+
+// When fragments' normals are worked out. ATTRIBUTES_IMMEDIATE interpolates a fragment's normal
+// as soon as it passes the depth test, even if a nearer fragment replaces it later.
+// ATTRIBUTES_DEFERRED first draws only depths and which face covers each sample, then works out
+// normals once for each sample that is still covered at the end, which saves work where many
+// faces overlap. Both give the same image.
+enum AttributeFill
+{
+	ATTRIBUTES_IMMEDIATE,
+	ATTRIBUTES_DEFERRED
+};
+
+// Which of the mesh's levels of detail is drawn. DETAIL_FULL always draws the mesh itself.
+// DETAIL_AUTO draws the coarsest level that strays from the mesh by at most half a sample on
+// screen, which for a mesh drawn small can be a small fraction of its faces. The levels are built
+// the first time they're asked for, which takes longer than a small render, so it only pays
+// for a mesh that is drawn many times.
+enum DetailLevel
+{
+	DETAIL_FULL,
+	DETAIL_AUTO
+};
+
+
+
+// A sub-rectangle of a canvas, in pixels. Rendering into a viewport only touches (and only
+// allocates buffers for) the pixels inside it.
+struct Viewport
+{
+	int x, y, width, height;
+	
+	Viewport(int, int, int, int);
+};
+
+struct ThreadPool;
+struct ShadingPalette;
+
+
+
+struct RenderOptions
+{
+	CullMode cullmode;
+	
+	// Each pixel takes the material covering most of its samples. supersampling is the number of
+	// samples along each edge of a pixel for SAMPLES_GRID, from 1 to 8, and is ignored by the
+	// sparse patterns.
+	SamplePattern samples;
+	int supersampling;
+	
+	GBufferFormat gbuffer;
+	Precision precision;
+	ShadingMode shading;
+	OutlineStyle outline;
+	FaceOrder order;
+	AttributeFill attributes;
+	DetailLevel detail;
+	
+	// Rasterization is spread over this pool's threads if it is set
+	ThreadPool *pool;
+	
+	RenderOptions();
+	RenderOptions(CullMode);
+};
+
+void render(
+	const Mesh&,
+	const Matrix4&,
+	const list<SunLight>&,
+	Image&,
+	const RenderOptions& = RenderOptions());
+
+void render(
+	const Mesh&,
+	const Matrix4&,
+	const list<SunLight>&,
+	Image&,
+	const Viewport&,
+	const RenderOptions& = RenderOptions());
+
+// Rendering into an indexed image shades each pixel to one of the palette's colors, which the
+// image's palette should be set to. The options' shading mode doesn't apply.
+void render(
+	const Mesh&,
+	const Matrix4&,
+	const ShadingPalette&,
+	IndexedImage&,
+	const RenderOptions& = RenderOptions());
+
 void render(
 	const Mesh&,
 	const Matrix4&,
+	const ShadingPalette&,
+	IndexedImage&,
+	const Viewport&,
+	const RenderOptions& = RenderOptions());
+
+
+
+// One view of a mesh in a batch: how the mesh is placed, and the part of the canvas it is drawn
+// into.
+struct Pose
+{
+	Matrix4 transform;
+	Viewport viewport;
+	
+	Pose(const Matrix4&, const Viewport&);
+};
+
+// Renders several views of the same mesh, in parallel if the options have a thread pool. Each
+// pose only draws inside its own viewport, so the viewports should not overlap.
+void render_batch(
+	const Mesh&,
+	const vector<Pose>&,
 	const list<SunLight>&,
 	Image&,
-	CullMode = CULL_NONE);
+	const RenderOptions& = RenderOptions());
+
+void render_batch(
+	const Mesh&,
+	const vector<Pose>&,
+	const ShadingPalette&,
+	IndexedImage&,
+	const RenderOptions& = RenderOptions());
 
 
 
@@ -0,0 +1,370 @@
+#include "Shading.h"
+
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <math.h>
+
+
+
+Color light_fragment(
+	const Vec3& loc,
+	const Vec3& normal,
+	const Material& mat,
+	const list<SunLight>& lights)
+{
+	Color color;
+					
+	// Ambient lighting
+	color = color + mat.ambient;
+	
+	for (list<SunLight>::const_iterator it = lights.begin(); it != lights.end(); it++)
+	{
+		const SunLight &light = *it;
+		
+		double bias = 0.2;
+		double alignment = (dot(light.direction, normal) + bias) / (1 + bias);
+		if (alignment > 0)
+		{
+			// Make shading granular
+			
+			if (alignment < 0.6) alignment = 0.4;
+			else alignment = 0.8;
+			
+			// Diffuse lighting
+			color = color + alignment * mat.diffuse * light.color;
+			
+			Vec3 reflection = (2 * alignment * normal - light.direction).normalize();
+			double eye_alignment = - dot(eye, reflection);
+			if (eye_alignment > 0)
+			{
+				// Specular lighting
+				color = color +
+					pow(eye_alignment, mat.shininess) *
+					mat.specular *
+					light.color;
+			}
+		}
+	}
+		
+	return color;
+}
+
+
+
+void FragmentBatch::resize(int size)
+{
+	nx.resize(size);
+	ny.resize(size);
+	nz.resize(size);
+	r.resize(size);
+	g.resize(size);
+	b.resize(size);
+	eye_alignment.resize(size);
+}
+
+// This is light_fragment() turned inside out: each light is applied to every fragment before
+// moving on to the next light. The arithmetic is done in the same order, so the results match
+// to the bit. The diffuse pass has no branches, and the specular pass only runs pow() for the
+// fragments that catch a highlight.
+void shade_fragments(
+	const Material& mat,
+	const list<SunLight>& lights,
+	FragmentBatch& batch,
+	int begin,
+	int end)
+{
+	const double *nx = &batch.nx[0], *ny = &batch.ny[0], *nz = &batch.nz[0];
+	double *r = &batch.r[0], *g = &batch.g[0], *b = &batch.b[0];
+	double *eye_alignment = &batch.eye_alignment[0];
+	
+	// Ambient lighting
+	for (int i=begin; i<end; i++)
+	{
+		r[i] = 0.0 + mat.ambient.r;
+		g[i] = 0.0 + mat.ambient.g;
+		b[i] = 0.0 + mat.ambient.b;
+	}
+	
+	for (list<SunLight>::const_iterator it = lights.begin(); it != lights.end(); it++)
+	{
+		const SunLight &light = *it;
+		double dx = light.direction.x, dy = light.direction.y, dz = light.direction.z;
+		double lr = light.color.r, lg = light.color.g, lb = light.color.b;
+		double bias = 0.2;
+		
+		// Diffuse lighting, made granular
+		for (int i=begin; i<end; i++)
+		{
+			double alignment = (dx*nx[i] + dy*ny[i] + dz*nz[i] + bias) / (1 + bias);
+			bool lit = alignment > 0;
+			double band = alignment < 0.6 ? 0.4 : 0.8;
+			
+			r[i] = lit ? r[i] + (band*mat.diffuse.r)*lr : r[i];
+			g[i] = lit ? g[i] + (band*mat.diffuse.g)*lg : g[i];
+			b[i] = lit ? b[i] + (band*mat.diffuse.b)*lb : b[i];
+			
+			double k = 2*band;
+			double rx = nx[i]*k - dx, ry = ny[i]*k - dy, rz = nz[i]*k - dz;
+			double inv_length = 1/sqrt(rx*rx + ry*ry + rz*rz);
+			double alignment2 = -(eye.x*(rx*inv_length) + eye.y*(ry*inv_length) + eye.z*(rz*inv_length));
+			eye_alignment[i] = lit && alignment2 > 0 ? alignment2 : 0;
+		}
+		
+		// Specular lighting
+		for (int i=begin; i<end; i++)
+		{
+			if (eye_alignment[i] > 0)
+			{
+				double specular = pow(eye_alignment[i], mat.shininess);
+				r[i] = r[i] + (mat.specular.r*specular)*lr;
+				g[i] = g[i] + (mat.specular.g*specular)*lg;
+				b[i] = b[i] + (mat.specular.b*specular)*lb;
+			}
+		}
+	}
+}
+
+
+
+// Cells along each side of a shading table
+const int table_size = 64;
+
+// Octahedral mapping: the point of the square [-1,1]x[-1,1] that a direction unfolds to, and back
+static void normal_to_square(const Vec3& n, double& u, double& v)
+{
+	double l1 = fabs(n.x) + fabs(n.y) + fabs(n.z);
+	u = n.x / l1;
+	v = n.y / l1;
+	if (n.z < 0)
+	{
+		double fu = (1 - fabs(v)) * (u >= 0 ? 1 : -1);
+		double fv = (1 - fabs(u)) * (v >= 0 ? 1 : -1);
+		u = fu;
+		v = fv;
+	}
+}
+
+static Vec3 square_to_normal(double u, double v)
+{
+	double z = 1 - fabs(u) - fabs(v);
+	if (z < 0)
+	{
+		double fu = (1 - fabs(v)) * (u >= 0 ? 1 : -1);
+		double fv = (1 - fabs(u)) * (v >= 0 ? 1 : -1);
+		u = fu;
+		v = fv;
+	}
+	return Vec3(u, v, z).normalize();
+}
+
+// A color channel as it ends up in an 8-bit image
+static int to_8bit(double c)
+{
+	return (uint8_t)(min(max(c, 0.0), 1.0) * 255);
+}
+
+ShadingTable::ShadingTable(const Material& _material, const list<SunLight>& _lights) :
+	material(_material),
+	lights(_lights),
+	colors(table_size*table_size),
+	states(table_size*table_size)
+{
+	for (unsigned int i=0; i<states.size(); i++) states[i].store(CELL_EMPTY);
+}
+
+Color ShadingTable::shade(const Vec3& normal)
+{
+	double u, v;
+	normal_to_square(normal, u, v);
+	
+	// Normals that aren't finite land in no cell
+	if (u == u && v == v)
+	{
+		int cx = min(max((int)((u+1) / 2 * table_size), 0), table_size-1);
+		int cy = min(max((int)((v+1) / 2 * table_size), 0), table_size-1);
+		int i = cx + cy*table_size;
+		
+		uint8_t state = states[i].load(memory_order_acquire);
+		if (state == CELL_EMPTY)
+		{
+			fill_cell(cx, cy);
+			state = states[i].load(memory_order_acquire);
+		}
+		if (state == CELL_UNIFORM) return colors[i];
+	}
+	
+	return light_fragment(Vec3(0,0,0), normal, material, lights);
+}
+
+// Samples the shading on a 3x3 grid across the cell. Only one thread fills a cell: any other
+// thread that wants it meanwhile shades exactly instead of waiting.
+void ShadingTable::fill_cell(int cx, int cy)
+{
+	int i = cx + cy*table_size;
+	uint8_t expected = CELL_EMPTY;
+	if (!states[i].compare_exchange_strong(expected, CELL_FILLING)) return;
+	
+	int low[3] = {255, 255, 255}, high[3] = {0, 0, 0};
+	for (int sx=0; sx<3; sx++) for (int sy=0; sy<3; sy++)
+	{
+		double u = -1 + 2 * (cx + sx/2.0) / table_size;
+		double v = -1 + 2 * (cy + sy/2.0) / table_size;
+		Color color = light_fragment(Vec3(0,0,0), square_to_normal(u, v), material, lights);
+		if (sx == 1 && sy == 1) colors[i] = color;
+		
+		int channels[3] = {to_8bit(color.r), to_8bit(color.g), to_8bit(color.b)};
+		for (int c=0; c<3; c++)
+		{
+			low[c] = min(low[c], channels[c]);
+			high[c] = max(high[c], channels[c]);
+		}
+	}
+	
+	bool uniform = high[0]-low[0] <= 1 && high[1]-low[1] <= 1 && high[2]-low[2] <= 1;
+	states[i].store(uniform ? CELL_UNIFORM : CELL_EXACT, memory_order_release);
+}
+
+
+
+// Tables made so far, by the values of their material and lights. Once there are more than
+// max_shading_tables, they are all dropped (renders still using one keep it alive).
+struct ShadingTableCache
+{
+	mutex lock;
+	map< vector<double>, shared_ptr<ShadingTable> > tables;
+};
+
+static ShadingTableCache table_cache;
+const unsigned int max_shading_tables = 256;
+
+shared_ptr<ShadingTable> shading_table(const Material& material, const list<SunLight>& lights)
+{
+	vector<double> key;
+	const Color *colors[3] = {&material.ambient, &material.diffuse, &material.specular};
+	for (int i=0; i<3; i++)
+	{
+		key.push_back(colors[i]->r);
+		key.push_back(colors[i]->g);
+		key.push_back(colors[i]->b);
+	}
+	key.push_back(material.shininess);
+	for (list<SunLight>::const_iterator it = lights.begin(); it != lights.end(); it++)
+	{
+		key.push_back(it->direction.x);
+		key.push_back(it->direction.y);
+		key.push_back(it->direction.z);
+		key.push_back(it->color.r);
+		key.push_back(it->color.g);
+		key.push_back(it->color.b);
+	}
+	
+	unique_lock<mutex> guard(table_cache.lock);
+	map< vector<double>, shared_ptr<ShadingTable> >::iterator found = table_cache.tables.find(key);
+	if (found != table_cache.tables.end()) return found->second;
+	
+	if (table_cache.tables.size() >= max_shading_tables) table_cache.tables.clear();
+	shared_ptr<ShadingTable> table(new ShadingTable(material, lights));
+	table_cache.tables[key] = table;
+	return table;
+}
+
+
+
+ShadingPalette::ShadingPalette(
+	const vector<const Material*>& materials,
+	const list<SunLight>& _lights,
+	const Color& background_color) :
+	lights(_lights)
+{
+	combinations = 1;
+	for (unsigned int l=0; l<lights.size(); l++)
+	{
+		combinations *= light_states;
+		if ((long)combinations * max<size_t>(materials.size(), 1) > 1<<20)
+			throw logic_error("too many lights for an 8-bit palette");
+	}
+	
+	colors.push_back(background_color);
+	colors.push_back(Color(0,0,0));
+	
+	// Colors that come out the same in 8 bits share an entry
+	map<int, uint8_t> found;
+	for (unsigned int i=0; i<colors.size(); i++)
+	{
+		const Color &c = colors[i];
+		found.insert(make_pair(to_8bit(c.r) << 16 | to_8bit(c.g) << 8 | to_8bit(c.b), i));
+	}
+	
+	indices.resize(materials.size() * combinations);
+	for (unsigned int m=0; m<materials.size(); m++)
+	{
+		const Material &mat = *materials[m];
+		half_highlight.push_back(mat.shininess > 0 ? pow(0.25, 1/mat.shininess) : 0);
+		full_highlight.push_back(mat.shininess > 0 ? pow(0.75, 1/mat.shininess) : 0);
+		
+		for (int combination=0; combination<combinations; combination++)
+		{
+			// The same sums as light_fragment(), with the highlight at its rounded level
+			Color color = Color() + mat.ambient;
+			int rest = combination;
+			for (list<SunLight>::const_iterator it = lights.begin(); it != lights.end(); it++)
+			{
+				int state = rest % light_states;
+				rest /= light_states;
+				if (state == 0) continue;
+				
+				double alignment = (state-1) / 3 ? 0.8 : 0.4;
+				double highlight = (state-1) % 3 / 2.0;
+				color = color + alignment * mat.diffuse * it->color;
+				color = color + highlight * mat.specular * it->color;
+			}
+			
+			int key = to_8bit(color.r) << 16 | to_8bit(color.g) << 8 | to_8bit(color.b);
+			map<int, uint8_t>::iterator entry = found.find(key);
+			if (entry == found.end())
+			{
+				if (colors.size() >= 256) throw logic_error("too many colors for an 8-bit palette");
+				entry = found.insert(make_pair(key, colors.size())).first;
+				colors.push_back(color);
+			}
+			indices[m*combinations + combination] = entry->second;
+		}
+	}
+}
+
+// Works out each light's state the way light_fragment() does, except that the highlight is
+// compared against the eye alignments at which it would round up, which saves a pow()
+uint8_t ShadingPalette::shade(int material, const Vec3& normal) const
+{
+	int combination = 0, scale = 1;
+	for (list<SunLight>::const_iterator it = lights.begin(); it != lights.end(); it++)
+	{
+		const SunLight &light = *it;
+		int state = 0;
+		
+		double bias = 0.2;
+		double alignment = (dot(light.direction, normal) + bias) / (1 + bias);
+		if (alignment > 0)
+		{
+			int band = alignment < 0.6 ? 0 : 1;
+			alignment = band ? 0.8 : 0.4;
+			
+			Vec3 reflection = (2 * alignment * normal - light.direction).normalize();
+			double eye_alignment = - dot(eye, reflection);
+			int level = 0;
+			if (eye_alignment > 0)
+			{
+				if (eye_alignment >= full_highlight[material]) level = 2;
+				else if (eye_alignment >= half_highlight[material]) level = 1;
+			}
+			
+			state = 1 + band*3 + level;
+		}
+		
+		combination += state*scale;
+		scale *= light_states;
+	}
+	
+	return indices[material*combinations + combination];
+}
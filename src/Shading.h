@@ -0,0 +1,112 @@
+#include "Geometry.h"
+#include "Image.h"
+#include "Mesh.h"
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <vector>
+
+using namespace std;
+
+
+
+#ifndef SHADING_H
+#define SHADING_H
+
+
+
+// The direction the camera looks from
+const Vec3 eye(0,0,1);
+
+// The lit color of a fragment, by the renderer's banded toon shading
+Color light_fragment(
+	const Vec3& loc,
+	const Vec3& normal,
+	const Material& mat,
+	const list<SunLight>& lights);
+
+
+
+// Fragments gathered to be shaded together. Each attribute has an array of its own, so that the
+// lighting loops run over contiguous memory and can work on several fragments at once.
+struct FragmentBatch
+{
+	vector<double> nx, ny, nz;
+	vector<double> r, g, b;
+	
+	// Scratch space for shade_fragments()
+	vector<double> eye_alignment;
+	
+	void resize(int);
+};
+
+// Lights fragments begin to end of a batch, which must all be of the same material, filling in
+// their colors. Gives exactly the same colors as light_fragment(), for any number of lights.
+void shade_fragments(const Material&, const list<SunLight>&, FragmentBatch&, int begin, int end);
+
+
+
+// Toon shading for one material under one set of lights, looked up by normal instead of
+// evaluated. The sphere of normals is unfolded onto a square (octahedral mapping) and split into
+// cells. A cell's color is worked out the first time a normal lands in it, by evaluating the
+// shading across the cell: if it stays within one 8-bit step, the cell's center color stands for
+// the whole cell, and if not (the cell straddles a band edge or a sharp highlight), normals that
+// land in it are shaded exactly. Cells may be filled in by several threads at once.
+struct ShadingTable
+{
+	// The table keeps its own copies, so it doesn't depend on the material or lights living on
+	Material material;
+	list<SunLight> lights;
+	
+	ShadingTable(const Material&, const list<SunLight>&);
+	
+	Color shade(const Vec3& normal);
+	
+private:
+	enum CellState { CELL_EMPTY, CELL_FILLING, CELL_UNIFORM, CELL_EXACT };
+	
+	vector<Color> colors;
+	vector< atomic<uint8_t> > states;
+	
+	void fill_cell(int, int);
+};
+
+// Finds the table for a material and set of lights, making it if there isn't one yet. Tables are
+// shared between renders, so their cells only need to be worked out once.
+shared_ptr<ShadingTable> shading_table(const Material&, const list<SunLight>&);
+
+
+
+// Shading for an 8-bit indexed render target. Under each light a fragment is either unlit or in
+// one of the two diffuse bands, with its highlight rounded to none, half or full, so each material
+// can only come out in a handful of colors. They are all worked out up front and put in one
+// palette, after the background and outline colors, and fragments are shaded straight to
+// palette indices. Throws logic_error if the colors don't fit in 256 entries.
+struct ShadingPalette
+{
+	static constexpr uint8_t background = 0, outline = 1;
+	
+	vector<Color> colors;
+	list<SunLight> lights;
+	
+	ShadingPalette(const vector<const Material*>&, const list<SunLight>&, const Color& background);
+	
+	// The palette index of a fragment of materials[material]
+	uint8_t shade(int material, const Vec3& normal) const;
+	
+private:
+	// A light's effect on a fragment is one of light_states: unlit, or a band and highlight level
+	static constexpr int light_states = 7;
+	
+	// Palette indices by material and the states of all the lights
+	int combinations;
+	vector<uint8_t> indices;
+	
+	// The eye alignment at which each material's highlight reaches half and full
+	vector<double> half_highlight, full_highlight;
+};
+
+
+
+#endif
@@ -0,0 +1,129 @@
+#include "Geometry.h"
+
+#include <math.h>
+#include <string.h>
+
+
+
+
+#ifndef SIMDMATH_H
+#define SIMDMATH_H
+
+
+
+// Single-precision math for the renderer's inner loops. Everything here is inline, and works on
+// four floats at once using the compiler's vector extensions, which become SSE instructions on
+// x86 (and whatever the target has elsewhere). Geometry.h's double types stay the reference.
+
+typedef float float4 __attribute__((vector_size(16)));
+
+// A 3-vector with a spare fourth lane, which can carry a value that is interpolated along with
+// it (such as a depth).
+struct Vec4f
+{
+	float4 v;
+	
+	Vec4f() {}
+	Vec4f(float4 _v) : v(_v) {}
+	Vec4f(float x, float y, float z, float w) { v = (float4){x, y, z, w}; }
+	
+	float x() const { return v[0]; }
+	float y() const { return v[1]; }
+	float z() const { return v[2]; }
+	float w() const { return v[3]; }
+	
+	Vec3 xyz() const { return Vec3(v[0], v[1], v[2]); }
+};
+
+inline Vec4f operator+(const Vec4f& a, const Vec4f& b) { return Vec4f(a.v + b.v); }
+inline Vec4f operator-(const Vec4f& a, const Vec4f& b) { return Vec4f(a.v - b.v); }
+inline Vec4f operator-(const Vec4f& a) { return Vec4f(-a.v); }
+inline Vec4f operator*(const Vec4f& a, float f) { return Vec4f(a.v * f); }
+inline Vec4f operator*(float f, const Vec4f& a) { return Vec4f(a.v * f); }
+
+// These ignore the fourth lane
+inline float dot3(const Vec4f& a, const Vec4f& b)
+{
+	float4 p = a.v * b.v;
+	return p[0] + p[1] + p[2];
+}
+inline Vec3 normalize3(const Vec4f& a)
+{
+	float inv = 1 / sqrtf(dot3(a, a));
+	return Vec3(a.v[0]*inv, a.v[1]*inv, a.v[2]*inv);
+}
+
+// Sums the vertices' values weighted by their affinities (barycentric coordinates)
+inline Vec4f interpolate(const Vec4f (&values)[3], const Vec3& affinities)
+{
+	return Vec4f(
+		values[0].v * (float)affinities.x +
+		values[1].v * (float)affinities.y +
+		values[2].v * (float)affinities.z);
+}
+
+
+
+// An affine transform, stored as the columns of its matrix
+struct Matrix4f
+{
+	float4 columns[4];
+	
+	Matrix4f(const Matrix4& m)
+	{
+		for (int i=0; i<4; i++)
+			columns[i] = (float4){(float)m.e[i][0], (float)m.e[i][1], (float)m.e[i][2], (float)m.e[i][3]};
+	}
+	
+	// Whether the matrix has no projective part, so it can be used without a divide
+	static bool is_affine(const Matrix4& m)
+	{
+		return m.e[0][3] == 0 && m.e[1][3] == 0 && m.e[2][3] == 0 && m.e[3][3] == 1;
+	}
+};
+
+inline Vec4f transform_point(const Matrix4f& m, const Point3& p)
+{
+	return Vec4f(
+		m.columns[0] * (float)p.x +
+		m.columns[1] * (float)p.y +
+		m.columns[2] * (float)p.z +
+		m.columns[3]);
+}
+
+inline Vec4f transform_vector(const Matrix4f& m, const Vec3& v)
+{
+	return Vec4f(
+		m.columns[0] * (float)v.x +
+		m.columns[1] * (float)v.y +
+		m.columns[2] * (float)v.z);
+}
+
+// Batch versions, for transforming all of a mesh's vertices
+inline void transform_points(const Matrix4f& m, const Point3* in, Vec4f* out, int count)
+{
+	for (int i=0; i<count; i++) out[i] = transform_point(m, in[i]);
+}
+
+inline void transform_vectors(const Matrix4f& m, const Vec3* in, Vec4f* out, int count)
+{
+	for (int i=0; i<count; i++) out[i] = transform_vector(m, in[i]);
+}
+
+
+
+// Two doubles, and the mask that comparing them gives
+typedef double double2 __attribute__((vector_size(16)));
+typedef long long mask2 __attribute__((vector_size(16)));
+
+// Loads two doubles from memory with no alignment needed
+inline double2 load2(const double* p)
+{
+	double2 v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+
+
+#endif
@@ -0,0 +1,497 @@
+#include "Mesh.h"
+
+#include <vector>
+#include <algorithm>
+#include <queue>
+#include <math.h>
+
+
+
+// Levels of detail are made by collapsing edges of the mesh one at a time, cheapest first, where
+// an edge's cost is the quadric error of moving one of its ends onto the other (Garland and
+// Heckbert's "Surface Simplification Using Quadric Error Metrics"). Only half-edge collapses are
+// made, so every vertex of a level is one of the original vertices, with its original normal.
+// 
+// The mesh's vertices are split where their normals or texture coordinates differ, so edges are
+// collapsed between positions rather than vertices. When a position is collapsed onto another,
+// each of its vertices is replaced by the other's vertex with the nearest normal, which keeps
+// hard edges where they were.
+// 
+// The toon shading's bands make changes in the normals just as visible as changes in shape, so a
+// collapse also costs the distance the band edges along it could move: the length of the edge
+// times the angle by which the normals at its far end turn.
+
+
+
+// Simplification stops once a level would have fewer faces than this
+const int min_lod_faces = 32;
+
+// a minus b (Point3's operator- gives b minus a)
+static inline Vec3 offset(const Point3& a, const Point3& b)
+{
+	return Vec3(a.x-b.x, a.y-b.y, a.z-b.z);
+}
+
+// The mean of the squared distances from a point to a set of planes. The sum is kept as the upper
+// triangle of a symmetric 4x4 matrix, along with the number of planes, so the square root of the
+// error is the point's root mean square distance from the planes, in the mesh's units.
+struct Quadric
+{
+	double q[10];
+	double planes;
+	
+	Quadric() { for (int i=0; i<10; i++) q[i] = 0; planes = 0; }
+	
+	// Adds the plane dot(n,p) + d = 0, where n has unit length
+	void add_plane(const Vec3& n, double d)
+	{
+		q[0] += n.x*n.x; q[1] += n.x*n.y; q[2] += n.x*n.z; q[3] += n.x*d;
+		q[4] += n.y*n.y; q[5] += n.y*n.z; q[6] += n.y*d;
+		q[7] += n.z*n.z; q[8] += n.z*d;
+		q[9] += d*d;
+		planes++;
+	}
+	
+	void add(const Quadric& other)
+	{
+		for (int i=0; i<10; i++) q[i] += other.q[i];
+		planes += other.planes;
+	}
+	
+	double error(const Point3& p) const
+	{
+		double x = p.x, y = p.y, z = p.z;
+		double e =
+			q[0]*x*x + 2*q[1]*x*y + 2*q[2]*x*z + 2*q[3]*x +
+			q[4]*y*y + 2*q[5]*y*z + 2*q[6]*y +
+			q[7]*z*z + 2*q[8]*z +
+			q[9];
+		return planes > 0 ? max(e, 0.0) / planes : 0;
+	}
+};
+
+// Orders vertices by position, so that vertices at the same position are next to each other
+struct PositionOrder
+{
+	const vector<Point3> &positions;
+	
+	PositionOrder(const vector<Point3>& _positions) : positions(_positions) {}
+	
+	bool operator()(uint32_t a, uint32_t b) const
+	{
+		const Point3 &p = positions[a], &q = positions[b];
+		if (p.x != q.x) return p.x < q.x;
+		if (p.y != q.y) return p.y < q.y;
+		return p.z < q.z;
+	}
+};
+
+// An edge of a face, between two positions, for finding the edges that border the mesh or a
+// change of material
+struct FaceEdge
+{
+	uint32_t low, high;
+	uint32_t face;
+	
+	bool operator<(const FaceEdge& other) const
+	{
+		if (low != other.low) return low < other.low;
+		if (high != other.high) return high < other.high;
+		return face < other.face;
+	}
+};
+
+// Collapsing position from onto position to, at the given cost. The versions are the positions'
+// at the time, and the collapse is stale if either has changed since.
+struct Collapse
+{
+	double cost;
+	uint32_t from, to;
+	uint32_t from_version, to_version;
+	
+	// Cheapest first, in a priority_queue
+	bool operator<(const Collapse& other) const { return cost > other.cost; }
+};
+
+// The working state of the simplification
+struct Simplifier
+{
+	const Mesh &mesh;
+	
+	// The position each vertex is at, and where each position is
+	vector<uint32_t> vertex_positions;
+	vector<Point3> positions;
+	
+	// The faces' vertices, which change as positions are collapsed, and which faces are left
+	vector<uint32_t> corners;
+	vector<uint8_t> face_alive;
+	int faces_left;
+	
+	// The faces around each position, and the planes they and the positions collapsed onto it
+	// started with. Lists may also hold faces that have since been removed or moved off the
+	// position; faces_at() drops them.
+	vector< vector<uint32_t> > position_faces;
+	vector<Quadric> quadrics;
+	vector<uint8_t> position_alive;
+	vector<uint32_t> versions;
+	
+	priority_queue<Collapse> queue;
+	
+	// The greatest error of any collapse so far, as a distance
+	double error;
+	
+	Simplifier(const Mesh&);
+	
+	uint32_t position_of(uint32_t face, int corner) const { return vertex_positions[corners[face*3+corner]]; }
+	bool face_has(uint32_t face, uint32_t position) const;
+	Vec3 face_normal(uint32_t face) const;
+	
+	const vector<uint32_t>& faces_at(uint32_t position);
+	void neighbours(uint32_t position, vector<uint32_t>& out);
+	void vertices_at(uint32_t position, vector<uint32_t>& out);
+	uint32_t nearest_normal(uint32_t vertex, const vector<uint32_t>& candidates) const;
+	double cost(uint32_t from, uint32_t to);
+	void add_collapses(uint32_t position);
+	bool collapse(const Collapse&);
+	
+	Mesh level() const;
+};
+
+Simplifier::Simplifier(const Mesh& _mesh) :
+	mesh(_mesh),
+	corners(_mesh.indices),
+	face_alive(_mesh.num_faces(), 1),
+	faces_left(_mesh.num_faces()),
+	error(0)
+{
+	// Merge vertices at the same position
+	int num_vertices = mesh.positions.size();
+	vector<uint32_t> sorted(num_vertices);
+	for (int i=0; i<num_vertices; i++) sorted[i] = i;
+	sort(sorted.begin(), sorted.end(), PositionOrder(mesh.positions));
+	
+	vertex_positions.resize(num_vertices);
+	for (int i=0; i<num_vertices; i++)
+	{
+		if (i == 0 || PositionOrder(mesh.positions)(sorted[i-1], sorted[i]))
+			positions.push_back(mesh.positions[sorted[i]]);
+		vertex_positions[sorted[i]] = positions.size() - 1;
+	}
+	
+	int num_positions = positions.size();
+	position_faces.resize(num_positions);
+	quadrics.resize(num_positions);
+	position_alive.assign(num_positions, 1);
+	versions.assign(num_positions, 0);
+	
+	// Each position starts with the planes of the faces around it
+	vector<FaceEdge> edges;
+	for (int f=0; f<mesh.num_faces(); f++)
+	{
+		Vec3 n = face_normal(f);
+		const Point3 &a = positions[position_of(f, 0)];
+		double d = -(n.x*a.x + n.y*a.y + n.z*a.z);
+		for (int i=0; i<3; i++)
+		{
+			uint32_t p = position_of(f, i), q = position_of(f, (i+1)%3);
+			position_faces[p].push_back(f);
+			quadrics[p].add_plane(n, d);
+			
+			FaceEdge edge;
+			edge.low = min(p, q);
+			edge.high = max(p, q);
+			edge.face = f;
+			edges.push_back(edge);
+		}
+	}
+	
+	// Edges with a face on only one side, or different materials on either side, also get planes
+	// through them, at right angles to their faces, so that the mesh's outline and the borders
+	// between materials keep their shape
+	sort(edges.begin(), edges.end());
+	for (unsigned int i=0; i<edges.size(); )
+	{
+		unsigned int j = i + 1;
+		bool border = false;
+		while (j < edges.size() && edges[j].low == edges[i].low && edges[j].high == edges[i].high)
+		{
+			if (mesh.face_materials[edges[j].face] != mesh.face_materials[edges[i].face]) border = true;
+			j++;
+		}
+		if (j == i + 1) border = true;
+		
+		if (border)
+		{
+			const Point3 &a = positions[edges[i].low], &b = positions[edges[i].high];
+			for (unsigned int k=i; k<j; k++)
+			{
+				Vec3 n = cross(offset(b, a), face_normal(edges[k].face));
+				double length = n.magnitude();
+				if (length == 0) continue;
+				n = n / length;
+				double d = -(n.x*a.x + n.y*a.y + n.z*a.z);
+				quadrics[edges[i].low].add_plane(n, d);
+				quadrics[edges[i].high].add_plane(n, d);
+			}
+		}
+		i = j;
+	}
+	
+	for (int p=0; p<num_positions; p++) add_collapses(p);
+}
+
+bool Simplifier::face_has(uint32_t face, uint32_t position) const
+{
+	return position_of(face, 0) == position || position_of(face, 1) == position || position_of(face, 2) == position;
+}
+
+// The face's unit normal, or zero if it has no area
+Vec3 Simplifier::face_normal(uint32_t face) const
+{
+	const Point3 &a = positions[position_of(face, 0)];
+	const Point3 &b = positions[position_of(face, 1)];
+	const Point3 &c = positions[position_of(face, 2)];
+	Vec3 n = cross(offset(b, a), offset(c, a));
+	double length = n.magnitude();
+	return length > 0 ? n / length : Vec3(0,0,0);
+}
+
+const vector<uint32_t>& Simplifier::faces_at(uint32_t position)
+{
+	vector<uint32_t> &faces = position_faces[position];
+	unsigned int kept = 0;
+	for (unsigned int i=0; i<faces.size(); i++)
+	{
+		uint32_t f = faces[i];
+		if (!face_alive[f] || !face_has(f, position)) continue;
+		
+		// A face can be added again when a position is collapsed onto one it was already around
+		bool seen = false;
+		for (unsigned int j=0; j<kept && !seen; j++) seen = faces[j] == f;
+		if (!seen) faces[kept++] = f;
+	}
+	faces.resize(kept);
+	return faces;
+}
+
+void Simplifier::neighbours(uint32_t position, vector<uint32_t>& out)
+{
+	out.clear();
+	const vector<uint32_t> &faces = faces_at(position);
+	for (unsigned int i=0; i<faces.size(); i++) for (int j=0; j<3; j++)
+	{
+		uint32_t p = position_of(faces[i], j);
+		if (p != position && find(out.begin(), out.end(), p) == out.end()) out.push_back(p);
+	}
+}
+
+// The vertices the faces around a position use there
+void Simplifier::vertices_at(uint32_t position, vector<uint32_t>& out)
+{
+	out.clear();
+	const vector<uint32_t> &faces = faces_at(position);
+	for (unsigned int i=0; i<faces.size(); i++) for (int j=0; j<3; j++)
+	{
+		uint32_t v = corners[faces[i]*3+j];
+		if (vertex_positions[v] == position && find(out.begin(), out.end(), v) == out.end())
+			out.push_back(v);
+	}
+}
+
+// The candidate whose normal is nearest the vertex's
+uint32_t Simplifier::nearest_normal(uint32_t vertex, const vector<uint32_t>& candidates) const
+{
+	uint32_t best = candidates[0];
+	double best_alignment = -INFINITY;
+	for (unsigned int i=0; i<candidates.size(); i++)
+	{
+		double alignment = dot(mesh.normals[vertex], mesh.normals[candidates[i]]);
+		if (alignment > best_alignment) { best = candidates[i]; best_alignment = alignment; }
+	}
+	return best;
+}
+
+// The squared error of collapsing from onto to: the mean squared distance of to from both
+// positions' planes, plus the squared distance the band edges could move
+double Simplifier::cost(uint32_t from, uint32_t to)
+{
+	Quadric both = quadrics[from];
+	both.add(quadrics[to]);
+	double shape = both.error(positions[to]);
+	
+	// For unit normals, the squared distance between them is about the square of the angle between
+	// them (and normals that are missing, and so zero, don't turn at all). The band edges can't
+	// move further than the faces around the edge reach, so the turn counts for at most the
+	// edge's length.
+	vector<uint32_t> from_vertices, to_vertices;
+	vertices_at(from, from_vertices);
+	vertices_at(to, to_vertices);
+	double turn = 0;
+	for (unsigned int i=0; i<from_vertices.size(); i++)
+	{
+		uint32_t v = from_vertices[i], w = nearest_normal(v, to_vertices);
+		Vec3 change = mesh.normals[v] - mesh.normals[w];
+		turn = max(turn, min(dot(change, change), 1.0));
+	}
+	Vec3 edge = offset(positions[to], positions[from]);
+	
+	return shape + dot(edge, edge)*turn;
+}
+
+// Queues the collapses of every edge around a position, both ways
+void Simplifier::add_collapses(uint32_t position)
+{
+	vector<uint32_t> around;
+	neighbours(position, around);
+	for (unsigned int i=0; i<around.size(); i++)
+	{
+		uint32_t other = around[i];
+		
+		Collapse c;
+		c.cost = cost(position, other);
+		c.from = position; c.to = other;
+		c.from_version = versions[position]; c.to_version = versions[other];
+		queue.push(c);
+		
+		c.cost = cost(other, position);
+		c.from = other; c.to = position;
+		queue.push(c);
+	}
+}
+
+// Makes a collapse if it is still current and wouldn't damage the mesh. Returns whether it was
+// made.
+bool Simplifier::collapse(const Collapse& c)
+{
+	uint32_t from = c.from, to = c.to;
+	if (!position_alive[from] || !position_alive[to]) return false;
+	if (versions[from] != c.from_version || versions[to] != c.to_version) return false;
+	
+	vector<uint32_t> faces = faces_at(from);
+	
+	// The faces on the edge go away. The edge must still be there, and the ends must have no
+	// other neighbours in common, or the collapse would pinch the surface.
+	vector<uint32_t> from_around, to_around;
+	neighbours(from, from_around);
+	neighbours(to, to_around);
+	int shared_faces = 0, shared_neighbours = 0;
+	for (unsigned int i=0; i<faces.size(); i++) if (face_has(faces[i], to)) shared_faces++;
+	for (unsigned int i=0; i<from_around.size(); i++)
+		if (find(to_around.begin(), to_around.end(), from_around[i]) != to_around.end()) shared_neighbours++;
+	if (shared_faces == 0 || shared_neighbours > shared_faces) return false;
+	
+	// The other faces around from must not flip over or lose their area
+	for (unsigned int i=0; i<faces.size(); i++)
+	{
+		uint32_t f = faces[i];
+		Vec3 normal = face_normal(f);
+		if (face_has(f, to) || normal.magnitude() == 0) continue;
+		
+		Point3 p[3];
+		for (int j=0; j<3; j++)
+		{
+			uint32_t q = position_of(f, j);
+			p[j] = positions[q == from ? to : q];
+		}
+		Vec3 moved = cross(offset(p[1], p[0]), offset(p[2], p[0]));
+		if (!(dot(moved, normal) > 0)) return false;
+	}
+	
+	vector<uint32_t> to_vertices;
+	vertices_at(to, to_vertices);
+	
+	// Each vertex at from is replaced by the vertex at to with the nearest normal
+	for (unsigned int i=0; i<faces.size(); i++)
+	{
+		uint32_t f = faces[i];
+		if (face_has(f, to))
+		{
+			face_alive[f] = 0;
+			faces_left--;
+			continue;
+		}
+		
+		for (int j=0; j<3; j++)
+		{
+			uint32_t &v = corners[f*3+j];
+			if (vertex_positions[v] == from) v = nearest_normal(v, to_vertices);
+		}
+		position_faces[to].push_back(f);
+	}
+	
+	position_alive[from] = 0;
+	quadrics[to].add(quadrics[from]);
+	versions[to]++;
+	error = max(error, sqrt(c.cost));
+	add_collapses(to);
+	return true;
+}
+
+// The mesh as it is now, with only the vertices it still uses
+Mesh Simplifier::level() const
+{
+	Mesh m;
+	m.materials = mesh.materials;
+	m.flat_normals = mesh.flat_normals;
+	m.lod_error = error;
+	
+	vector<int> new_index(mesh.positions.size(), -1);
+	for (int f=0; f<mesh.num_faces(); f++)
+	{
+		if (!face_alive[f]) continue;
+		for (int i=0; i<3; i++)
+		{
+			uint32_t v = corners[f*3+i];
+			if (new_index[v] < 0)
+			{
+				new_index[v] = m.positions.size();
+				m.positions.push_back(mesh.positions[v]);
+				m.normals.push_back(mesh.normals[v]);
+				m.texcoords.push_back(mesh.texcoords[v]);
+			}
+			m.indices.push_back(new_index[v]);
+		}
+		m.face_materials.push_back(mesh.face_materials[f]);
+	}
+	
+	m.build_bvh();
+	
+	// A flat-shaded level takes the normals of its own faces
+	if (m.flat_normals) m.autocompute_normals();
+	
+	// Levels aren't simplified any further
+	m.lods_guard.built = true;
+	return m;
+}
+
+
+
+void Mesh::build_lods() const
+{
+	lods.clear();
+	if (num_faces() * 3/4 < min_lod_faces)
+	{
+		lods_guard.built = true;
+		return;
+	}
+	
+	// Levels are closer together than halves, so that whatever size the mesh is drawn at, there is
+	// one not far under the error allowed there
+	Simplifier simplifier(*this);
+	int target = num_faces() * 3/4;
+	while (target >= min_lod_faces && !simplifier.queue.empty())
+	{
+		Collapse c = simplifier.queue.top();
+		simplifier.queue.pop();
+		simplifier.collapse(c);
+		
+		if (simplifier.faces_left <= target)
+		{
+			lods.push_back(simplifier.level());
+			target = simplifier.faces_left * 3/4;
+		}
+	}
+	
+	// Only now may level_of_detail() read the levels without taking the lock
+	lods_guard.built = true;
+}
@@ -2,33 +2,88 @@
 #include "Render.h"
 #include "Image.h"
 #include "Mesh.h"
+#include "Shading.h"
+#include "ThreadPool.h"
 
 #include <stdio.h>
 #include <math.h>
 #include <cstdlib>
+#include <sstream>
+#include <memory>
+#include <stdexcept>
 
 
 
-int main(int argc, char *argv[])
+// Everything needed to produce one sprite sheet
+struct RenderJob
 {
 	string obj_path;
 	string mtl_search_dir;
-	string output_path = "render.tga";
+	string output_path;
+	bool rle;
+	bool indexed;
 	int img_width;
 	int img_height;
 	double size_factor;
-	double pitch = 0;
-	double yaw = 0;
-	Vec3 light_angle(1,-2,0);
-	Color light_color(1,1,1);
-	CullMode cullmode = CULL_NONE;
-	bool autocompute_normals = false;
-	
-	if (argc<5)
-	{
-		cout << "need at least 4 arguments: model, width, height, scale factor" << endl;
-		exit(1);
-	}
+	double pitch;
+	double yaw;
+	Vec3 light_angle;
+	Color light_color;
+	CullMode cullmode;
+	SamplePattern samples;
+	int supersampling;
+	GBufferFormat gbuffer;
+	Precision precision;
+	ShadingMode shading;
+	OutlineStyle outline;
+	FaceOrder order;
+	AttributeFill attributes;
+	DetailLevel detail;
+	bool autocompute_normals;
+	string cache_path;
+	bool build_cache;
+	int num_images;
+	int num_threads;
+	
+	RenderJob();
+};
+
+RenderJob::RenderJob() :
+	output_path("render.tga"),
+	rle(false),
+	indexed(false),
+	img_width(0),
+	img_height(0),
+	size_factor(0),
+	pitch(0),
+	yaw(0),
+	light_angle(1,-2,0),
+	light_color(1,1,1),
+	cullmode(CULL_NONE),
+	samples(SAMPLES_GRID),
+	supersampling(3),
+	gbuffer(GBUFFER_FULL),
+	precision(PRECISION_FLOAT),
+	shading(SHADING_EXACT),
+	outline(OUTLINE_MATERIAL),
+	order(ORDER_MESH),
+	attributes(ATTRIBUTES_IMMEDIATE),
+	detail(DETAIL_FULL),
+	autocompute_normals(false),
+	build_cache(false),
+	num_images(8)
+{
+	num_threads = thread::hardware_concurrency();
+	if (num_threads <= 0) num_threads = 1;
+}
+
+
+
+// Fills in a job from command line arguments. argv[0] is skipped. Throws logic_error if the
+// arguments are bad.
+void parse_job(int argc, char *argv[], RenderJob& job)
+{
+	if (argc<5) throw logic_error("need at least 4 arguments: model, width, height, scale factor");
 	
 	for (int i=0; i<argc; i++)
 	{
@@ -39,100 +94,249 @@ int main(int argc, char *argv[])
 		}
 		else if (i==1)
 		{
-			obj_path = arg;
+			job.obj_path = arg;
 			
-			size_t last_slash_pos = obj_path.find_last_of('/');
-			if (last_slash_pos == string::npos) mtl_search_dir = "";
-			else mtl_search_dir = obj_path.substr(0, last_slash_pos+1);
+			size_t last_slash_pos = job.obj_path.find_last_of('/');
+			if (last_slash_pos == string::npos) job.mtl_search_dir = "";
+			else job.mtl_search_dir = job.obj_path.substr(0, last_slash_pos+1);
 		}
 		else if (i==2)
 		{
-			img_width = atoi(arg);
-			if (img_width <= 0) { cout << "bad image width" << endl; exit(1); }
+			job.img_width = atoi(arg);
+			if (job.img_width <= 0) throw logic_error("bad image width");
 		}
 		else if (i==3) 
 		{
-			img_height = atoi(arg);
-			if (img_height <= 0) { cout << "bad image height" << endl; exit(1); }
+			job.img_height = atoi(arg);
+			if (job.img_height <= 0) throw logic_error("bad image height");
 		}
 		else if (i==4)
 		{
-			size_factor = atof(arg);
-			if (size_factor == 0) { cout << "bad size factor" << endl; exit(1); }
+			job.size_factor = atof(arg);
+			if (job.size_factor == 0) throw logic_error("bad size factor");
 		}
 		else if (string(arg) == "-o" || string(arg) == "--output")
 		{
 			i++;
-			if (i >= argc) { cout << "--output needs an argument" << endl; exit(1); }
-			output_path = argv[i];
+			if (i >= argc) throw logic_error("--output needs an argument");
+			job.output_path = argv[i];
+		}
+		else if (string(arg) == "--rle")
+		{
+			job.rle = true;
+		}
+		else if (string(arg) == "--indexed")
+		{
+			job.indexed = true;
 		}
 		else if (string(arg) == "--pitch")
 		{
 			i++;
-			if (i >= argc) { cout << "--pitch needs an argument" << endl; exit(1); }
-			pitch = atof(argv[i])*M_PI/180;
+			if (i >= argc) throw logic_error("--pitch needs an argument");
+			job.pitch = atof(argv[i])*M_PI/180;
 		}
 		else if (string(arg) == "--yaw")
 		{
 			i++;
-			if (i >= argc) { cout << "--yaw needs an argument" << endl; exit(1); }
-			yaw = atof(argv[i])*M_PI/180;
+			if (i >= argc) throw logic_error("--yaw needs an argument");
+			job.yaw = atof(argv[i])*M_PI/180;
 		}
 		else if (string(arg) == "--lightangle")
 		{
-			if (i+3 >= argc) { cout << "--lightangle needs three argumnts" << endl; exit(1); }
-			light_angle.x = atof(argv[i+1]);
-			light_angle.y = atof(argv[i+2]);
-			light_angle.z = atof(argv[i+3]);
+			if (i+3 >= argc) throw logic_error("--lightangle needs three argumnts");
+			job.light_angle.x = atof(argv[i+1]);
+			job.light_angle.y = atof(argv[i+2]);
+			job.light_angle.z = atof(argv[i+3]);
 			i += 3;
 		}
 		else if (string(arg) == "--lightcolor")
 		{
-			if (i+3 >= argc) { cout << "--lightcolor needs three argumnts" << endl; exit(1); }
-			light_color.r = atof(argv[i+1]);
-			light_color.g = atof(argv[i+2]);
-			light_color.b = atof(argv[i+3]);
+			if (i+3 >= argc) throw logic_error("--lightcolor needs three argumnts");
+			job.light_color.r = atof(argv[i+1]);
+			job.light_color.g = atof(argv[i+2]);
+			job.light_color.b = atof(argv[i+3]);
 			i += 3;
 		}
 		else if (string(arg) == "--autocompute-normals")
 		{
-			autocompute_normals = true;
+			job.autocompute_normals = true;
+		}
+		else if (string(arg) == "--cache")
+		{
+			i++;
+			if (i >= argc) throw logic_error("--cache needs an argument");
+			job.cache_path = argv[i];
+		}
+		else if (string(arg) == "--build-cache")
+		{
+			job.build_cache = true;
 		}
 		else if (string(arg) == "--cull")
 		{
 			i++;
-			if (i >= argc) { cout << "--cull needs an argument" << endl; exit(1); }
-			if (string(argv[i]) == "front") cullmode = CULL_FRONT;
-			else if (string(argv[i]) == "back") cullmode = CULL_BACK;
-			else if (string(argv[i]) == "none") cullmode = CULL_NONE;
-			else { cout << "--cull expects 'front', 'back', or 'none'" << endl; exit(1); }
+			if (i >= argc) throw logic_error("--cull needs an argument");
+			if (string(argv[i]) == "front") job.cullmode = CULL_FRONT;
+			else if (string(argv[i]) == "back") job.cullmode = CULL_BACK;
+			else if (string(argv[i]) == "none") job.cullmode = CULL_NONE;
+			else throw logic_error("--cull expects 'front', 'back', or 'none'");
+		}
+		else if (string(arg) == "--ssf")
+		{
+			i++;
+			if (i >= argc) throw logic_error("--ssf needs an argument");
+			job.supersampling = atoi(argv[i]);
+			if (job.supersampling < 1 || job.supersampling > 8)
+				throw logic_error("--ssf expects a number from 1 to 8");
+		}
+		else if (string(arg) == "--samples")
+		{
+			i++;
+			if (i >= argc) throw logic_error("--samples needs an argument");
+			if (string(argv[i]) == "grid") job.samples = SAMPLES_GRID;
+			else if (string(argv[i]) == "rotated") job.samples = SAMPLES_ROTATED_GRID;
+			else if (string(argv[i]) == "queens") job.samples = SAMPLES_QUEENS;
+			else throw logic_error("--samples expects 'grid', 'rotated', or 'queens'");
+		}
+		else if (string(arg) == "--gbuffer")
+		{
+			i++;
+			if (i >= argc) throw logic_error("--gbuffer needs an argument");
+			if (string(argv[i]) == "full") job.gbuffer = GBUFFER_FULL;
+			else if (string(argv[i]) == "packed") job.gbuffer = GBUFFER_PACKED;
+			else throw logic_error("--gbuffer expects 'full' or 'packed'");
+		}
+		else if (string(arg) == "--precision")
+		{
+			i++;
+			if (i >= argc) throw logic_error("--precision needs an argument");
+			if (string(argv[i]) == "float") job.precision = PRECISION_FLOAT;
+			else if (string(argv[i]) == "double") job.precision = PRECISION_DOUBLE;
+			else throw logic_error("--precision expects 'float' or 'double'");
+		}
+		else if (string(arg) == "--shading")
+		{
+			i++;
+			if (i >= argc) throw logic_error("--shading needs an argument");
+			if (string(argv[i]) == "exact") job.shading = SHADING_EXACT;
+			else if (string(argv[i]) == "table") job.shading = SHADING_TABLE;
+			else throw logic_error("--shading expects 'exact' or 'table'");
+		}
+		else if (string(arg) == "--outline")
+		{
+			i++;
+			if (i >= argc) throw logic_error("--outline needs an argument");
+			if (string(argv[i]) == "material") job.outline = OUTLINE_MATERIAL;
+			else if (string(argv[i]) == "discontinuity") job.outline = OUTLINE_DISCONTINUITY;
+			else if (string(argv[i]) == "none") job.outline = OUTLINE_NONE;
+			else throw logic_error("--outline expects 'material', 'discontinuity', or 'none'");
+		}
+		else if (string(arg) == "--order")
+		{
+			i++;
+			if (i >= argc) throw logic_error("--order needs an argument");
+			if (string(argv[i]) == "mesh") job.order = ORDER_MESH;
+			else if (string(argv[i]) == "front-to-back") job.order = ORDER_FRONT_TO_BACK;
+			else throw logic_error("--order expects 'mesh' or 'front-to-back'");
+		}
+		else if (string(arg) == "--attributes")
+		{
+			i++;
+			if (i >= argc) throw logic_error("--attributes needs an argument");
+			if (string(argv[i]) == "immediate") job.attributes = ATTRIBUTES_IMMEDIATE;
+			else if (string(argv[i]) == "deferred") job.attributes = ATTRIBUTES_DEFERRED;
+			else throw logic_error("--attributes expects 'immediate' or 'deferred'");
+		}
+		else if (string(arg) == "--detail")
+		{
+			i++;
+			if (i >= argc) throw logic_error("--detail needs an argument");
+			if (string(argv[i]) == "auto") job.detail = DETAIL_AUTO;
+			else if (string(argv[i]) == "full") job.detail = DETAIL_FULL;
+			else throw logic_error("--detail expects 'auto' or 'full'");
+		}
+		else if (string(arg) == "--views")
+		{
+			i++;
+			if (i >= argc) throw logic_error("--views needs an argument");
+			job.num_images = atoi(argv[i]);
+			if (job.num_images <= 0) throw logic_error("bad view count");
+		}
+		else if (string(arg) == "--threads")
+		{
+			i++;
+			if (i >= argc) throw logic_error("--threads needs an argument");
+			job.num_threads = atoi(argv[i]);
+			if (job.num_threads <= 0) throw logic_error("bad thread count");
 		}
 		else
 		{
-			cout << "do not recognize "+string(arg) << endl;
-			exit(1);
+			throw logic_error("do not recognize "+string(arg));
 		}
 	}
 	
-	ifstream model_file(obj_path.c_str(), ios_base::in);
-	Mesh model = Mesh::from_objfile(model_file, mtl_search_dir);
-	model_file.close();
+}
+
+// Loads a job's model. A model may be a mesh cache file itself. Otherwise, if there's a cache
+// file that is up to date, use that instead of parsing the model, and if not, (re)build it.
+Mesh load_model(const RenderJob& job)
+{
+	Mesh model;
 	
-	if (autocompute_normals)
+	size_t ext_pos = job.obj_path.rfind(".rrmesh");
+	if (ext_pos != string::npos && ext_pos + 7 == job.obj_path.size())
 	{
-		for (list<Face>::iterator it = model.faces.begin();
-			it != model.faces.end(); it++)
-		{
-			Face &f = *it;
-			f.autocompute_normals();
-		}
+		if (!Mesh::from_cachefile(job.obj_path, model, false))
+			throw logic_error("could not load mesh cache "+job.obj_path);
+		if (job.autocompute_normals && !model.flat_normals) model.autocompute_normals();
+		return model;
 	}
+	
+	if (!job.cache_path.empty() && !job.build_cache &&
+		Mesh::from_cachefile(job.cache_path, model) &&
+		!model.sources.empty() && model.sources[0] == job.obj_path &&
+		model.flat_normals == job.autocompute_normals)
+	{
+		return model;
+	}
+	
+	model = Mesh::from_objfile(job.obj_path, job.mtl_search_dir);
+	if (job.autocompute_normals) model.autocompute_normals();
+	if (!job.cache_path.empty()) model.write_cachefile(job.cache_path);
+	return model;
+}
 
-	int num_images = 8;
+// Writes a rendered sheet, as a PNG if the path ends in .png and as a TGA otherwise
+template<typename Canvas> void write_output(const RenderJob& job, Canvas& canvas)
+{
+	ofstream output_file(job.output_path.c_str(), ios_base::out | ios_base::binary);
+	if (!output_file) throw logic_error("failed to open output file "+job.output_path);
+	size_t ext_pos = job.output_path.rfind(".png");
+	if (ext_pos != string::npos && ext_pos + 4 == job.output_path.size()) canvas.write_PNG(output_file);
+	else canvas.write_TGA(output_file, job.rle);
+	output_file.close();
+}
 
-	Image canvas(img_width*num_images, img_height);
-	canvas.clear(Color(0.5,0.5,0.5));
+void render_job(const RenderJob& job, const Mesh& model, ThreadPool& pool)
+{
+	int img_width = job.img_width, img_height = job.img_height, num_images = job.num_images;
 	
+	RenderOptions options(job.cullmode);
+	options.samples = job.samples;
+	options.supersampling = job.supersampling;
+	options.gbuffer = job.gbuffer;
+	options.precision = job.precision;
+	options.shading = job.shading;
+	options.outline = job.outline;
+	options.order = job.order;
+	options.attributes = job.attributes;
+	options.detail = job.detail;
+	options.pool = &pool;
+	
+	Color background(0.5,0.5,0.5);
+	list<SunLight> lights;
+	lights.push_back(SunLight(job.light_angle, job.light_color));
+	
+	vector<Pose> poses;
 	for (int i=0; i<num_images; i++)
 	{
 		Matrix4 transform = Matrix4::identity;
@@ -141,22 +345,233 @@ int main(int argc, char *argv[])
 		transform = transform * Matrix4::translation(Vec3(img_width/2+img_width*i,img_height/2,0));
 		
 		// Scale image by desired scaling factor
-		double sf = size_factor * img_height;
+		double sf = job.size_factor * img_height;
 		transform = transform * Matrix4::scaling(Vec3(sf,sf,sf));
 		
 		// Pitch image
-		transform = transform * Matrix4::rotation(pitch, Vec3(1,0,0));
+		transform = transform * Matrix4::rotation(job.pitch, Vec3(1,0,0));
 		
 		// Yaw image
-		transform = transform * Matrix4::rotation(yaw + i*2*M_PI/num_images, Vec3(0,1,0));
+		transform = transform * Matrix4::rotation(job.yaw + i*2*M_PI/num_images, Vec3(0,1,0));
 		
-		list<SunLight> lights;
-		lights.push_back(SunLight(light_angle, light_color));
+		poses.push_back(Pose(transform, Viewport(img_width*i, 0, img_width, img_height)));
+	}
+	
+	if (job.indexed)
+	{
+		ShadingPalette palette(model.materials, lights, background);
+		IndexedImage canvas(img_width*num_images, img_height);
+		canvas.palette = palette.colors;
+		canvas.fill(ShadingPalette::background);
+		render_batch(model, poses, palette, canvas, options);
+		write_output(job, canvas);
+	}
+	else
+	{
+		Image canvas(img_width*num_images, img_height);
+		canvas.fill(background);
+		render_batch(model, poses, lights, canvas, options);
+		write_output(job, canvas);
+	}
+}
+
+
+
+// A mesh kept loaded in server mode, with the size and modification time its files had when
+// it was loaded. The entry owns the mesh and its materials.
+struct MeshCacheEntry
+{
+	string key;
+	unique_ptr<Mesh> mesh;
+	vector<string> files;
+	vector<int64_t> sizes;
+	vector<int64_t> mtimes;
+	
+	MeshCacheEntry() {}
+	MeshCacheEntry(MeshCacheEntry&&) = default;
+	~MeshCacheEntry() { if (mesh) mesh->delete_materials(); }
+	
+	// Whether any of the files has changed (or gone) since
+	bool stale() const;
+};
+
+bool MeshCacheEntry::stale() const
+{
+	for (unsigned int i=0; i<files.size(); i++)
+	{
+		int64_t size, mtime;
+		if (!stat_source(files[i], size, mtime)) return true;
+		if (size != sizes[i] || mtime != mtimes[i]) return true;
+	}
+	return false;
+}
+
+// Meshes kept loaded between jobs in server mode, most recently used first. A mesh whose files
+// have changed on disk is dropped and loaded again, just like a stale cache file.
+struct MeshCache
+{
+	list<MeshCacheEntry> entries;
+	unsigned int capacity;
+	
+	MeshCache(int _capacity) : capacity(_capacity)
+	{
+	}
+	
+	// loaded is set if the mesh wasn't already in the cache
+	const Mesh& get(const RenderJob& job, bool& loaded)
+	{
+		ostringstream key_ss;
+		key_ss << job.obj_path << '\n' << job.cache_path << '\n' << job.autocompute_normals;
+		string key = key_ss.str();
+		
+		for (list<MeshCacheEntry>::iterator it = entries.begin(); it != entries.end(); it++)
+		{
+			if ((*it).key == key)
+			{
+				entries.splice(entries.begin(), entries, it);
+				if (!entries.front().stale())
+				{
+					loaded = false;
+					return *entries.front().mesh;
+				}
+				
+				// Moved to the front, so that's where it's dropped from
+				entries.pop_front();
+				break;
+			}
+		}
+		
+		MeshCacheEntry entry;
+		entry.key = key;
+		entry.mesh.reset(new Mesh(load_model(job)));
 		
-		render(model, transform, lights, canvas, cullmode);
+		// A mesh cache file given as the model is the only file it depends on
+		size_t ext_pos = job.obj_path.rfind(".rrmesh");
+		if (ext_pos != string::npos && ext_pos + 7 == job.obj_path.size())
+			entry.files.push_back(job.obj_path);
+		else
+			entry.files = entry.mesh->sources;
+		
+		for (unsigned int i=0; i<entry.files.size(); i++)
+		{
+			int64_t size = -1, mtime = -1;
+			stat_source(entry.files[i], size, mtime);
+			entry.sizes.push_back(size);
+			entry.mtimes.push_back(mtime);
+		}
+		
+		entries.push_front(move(entry));
+		while (entries.size() > capacity) entries.pop_back();
+		loaded = true;
+		return *entries.front().mesh;
 	}
+};
+
+// Reads jobs from stdin, one per line, written just like RetroRenderer's arguments (model,
+// width, height, scale factor, then options). Replies to each line with "ok" or "error: <reason>",
+// so a client can send several jobs before reading the replies.
+// Meshes stay loaded between jobs, and so do the renderer's buffers. Since a mesh's levels of
+// detail are kept along with it, jobs draw them by default (--detail auto).
+void serve(int num_threads, int mesh_cache_size)
+{
+	ThreadPool pool(num_threads);
+	MeshCache meshes(mesh_cache_size);
 	
-	ofstream output_file(output_path.c_str(), ios_base::out);
-	canvas.write_TGA(output_file);
-	output_file.close();
+	string line;
+	while (getline(cin, line))
+	{
+		istringstream line_ss(line);
+		vector<string> words;
+		string word;
+		while (line_ss >> word) words.push_back(word);
+		if (words.empty())
+		{
+			cout << "error: empty job" << endl;
+			continue;
+		}
+		if (words.size() == 1 && words[0] == "quit") break;
+		
+		// parse_job expects a program name first
+		vector<char*> args;
+		args.push_back((char*)"RetroRenderer");
+		for (unsigned int i=0; i<words.size(); i++) args.push_back(&words[i][0]);
+		
+		try
+		{
+			// The thread pool is shared by every job
+			for (unsigned int i=0; i<words.size(); i++)
+				if (words[i] == "--threads") throw logic_error("--threads can only be given to --serve");
+			
+			RenderJob job;
+			job.detail = DETAIL_AUTO;
+			parse_job(args.size(), &args[0], job);
+			if (job.build_cache && job.cache_path.empty()) throw logic_error("--build-cache needs --cache");
+			
+			bool loaded;
+			const Mesh &model = meshes.get(job, loaded);
+			
+			// Loading a mesh writes its cache file, but one that was already loaded must write it here
+			if (job.build_cache && !loaded) model.write_cachefile(job.cache_path);
+			if (!job.build_cache) render_job(job, model, pool);
+			cout << "ok" << endl;
+		}
+		catch (const exception& e)
+		{
+			cout << "error: " << e.what() << endl;
+		}
+	}
+}
+
+
+
+int main(int argc, char *argv[])
+{
+	if (argc >= 2 && string(argv[1]) == "--serve")
+	{
+		int num_threads = RenderJob().num_threads;
+		int mesh_cache_size = 16;
+		for (int i=2; i<argc; i++)
+		{
+			if (string(argv[i]) == "--threads" && i+1 < argc)
+			{
+				num_threads = atoi(argv[++i]);
+				if (num_threads <= 0) { cout << "bad thread count" << endl; exit(1); }
+			}
+			else if (string(argv[i]) == "--mesh-cache" && i+1 < argc)
+			{
+				mesh_cache_size = atoi(argv[++i]);
+				if (mesh_cache_size <= 0) { cout << "bad mesh cache size" << endl; exit(1); }
+			}
+			else
+			{
+				cout << "do not recognize "+string(argv[i]) << endl;
+				exit(1);
+			}
+		}
+		
+		serve(num_threads, mesh_cache_size);
+		return 0;
+	}
+	
+	RenderJob job;
+	try
+	{
+		parse_job(argc, argv, job);
+	}
+	catch (const logic_error& e)
+	{
+		cout << e.what() << endl;
+		exit(1);
+	}
+	
+	Mesh model = load_model(job);
+	
+	if (job.build_cache)
+	{
+		if (job.cache_path.empty()) { cout << "--build-cache needs --cache" << endl; exit(1); }
+		exit(0);
+	}
+	
+	ThreadPool pool(job.num_threads);
+	render_job(job, model, pool);
 }
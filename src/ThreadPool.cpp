@@ -0,0 +1,130 @@
+#include "ThreadPool.h"
+
+
+
+// Which pool (if any) the current thread works for, and the index of its queue
+static thread_local ThreadPool* current_pool = NULL;
+static thread_local int current_queue = 0;
+
+
+
+ThreadPool::ThreadPool(int num_threads)
+{
+	pending = 0;
+	stopping = false;
+	
+	// The calling thread counts as one of the threads. Queue 0 is for outside threads.
+	int num_workers = num_threads > 1 ? num_threads-1 : 0;
+	for (int i=0; i<=num_workers; i++) queues.push_back(new Queue);
+	for (int i=1; i<=num_workers; i++)
+		workers.push_back(thread(&ThreadPool::worker_main, this, i));
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		unique_lock<mutex> guard(lock);
+		stopping = true;
+	}
+	changed.notify_all();
+	
+	for (unsigned int i=0; i<workers.size(); i++) workers[i].join();
+	for (unsigned int i=0; i<queues.size(); i++) delete queues[i];
+}
+
+int ThreadPool::size() const
+{
+	return workers.size() + 1;
+}
+
+void ThreadPool::run(int count, void (*job)(int, void*), void* context)
+{
+	if (count <= 0) return;
+	
+	if (workers.empty())
+	{
+		for (int i=0; i<count; i++) job(i, context);
+		return;
+	}
+	
+	Batch batch;
+	batch.job = job;
+	batch.context = context;
+	batch.remaining = count;
+	
+	// Workers queue their own jobs, to be stolen by idle threads. Outside threads use the
+	// shared queue.
+	int queue = current_pool == this ? current_queue : 0;
+	{
+		Queue &q = *queues[queue];
+		unique_lock<mutex> guard(q.lock);
+		for (int i=0; i<count; i++)
+		{
+			Task task = {&batch, i};
+			q.tasks.push_back(task);
+		}
+	}
+	{
+		unique_lock<mutex> guard(lock);
+		pending += count;
+	}
+	changed.notify_all();
+	
+	// Help out until the whole batch is done
+	while (batch.remaining > 0)
+	{
+		if (run_one(queue)) continue;
+		
+		unique_lock<mutex> guard(lock);
+		while (batch.remaining > 0 && pending == 0) changed.wait(guard);
+	}
+}
+
+void ThreadPool::worker_main(int queue)
+{
+	current_pool = this;
+	current_queue = queue;
+	
+	while (true)
+	{
+		if (run_one(queue)) continue;
+		
+		unique_lock<mutex> guard(lock);
+		while (!stopping && pending == 0) changed.wait(guard);
+		if (stopping) return;
+	}
+}
+
+// Runs one task: the newest one from the given queue if there is one, otherwise the oldest one
+// that can be stolen from another queue. Returns false if every queue was empty.
+bool ThreadPool::run_one(int queue)
+{
+	Task task;
+	bool found = false;
+	
+	for (unsigned int i=0; i<queues.size() && !found; i++)
+	{
+		int victim = (queue + i) % queues.size();
+		Queue &q = *queues[victim];
+		unique_lock<mutex> guard(q.lock);
+		if (q.tasks.empty()) continue;
+		
+		if (victim == queue) { task = q.tasks.back(); q.tasks.pop_back(); }
+		else { task = q.tasks.front(); q.tasks.pop_front(); }
+		found = true;
+	}
+	if (!found) return false;
+	
+	pending--;
+	
+	task.batch->job(task.index, task.batch->context);
+	
+	if (--task.batch->remaining == 0)
+	{
+		// Wake up the thread waiting on this batch. The batch may be gone as soon as remaining
+		// reaches zero, so it must not be touched after this point.
+		unique_lock<mutex> guard(lock);
+		changed.notify_all();
+	}
+	return true;
+}
@@ -0,0 +1,72 @@
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+using namespace std;
+
+
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+
+
+// A fixed set of worker threads which are handed batches of independent jobs. Each thread has its
+// own queue of jobs and steals from the others when its queue runs dry. The thread that submits a
+// batch works on jobs too while it waits, so a job may itself submit a batch (for instance, a pose
+// can submit its screen tiles) without deadlocking the pool. A pool of size 1 has no worker
+// threads at all and runs everything inline.
+struct ThreadPool
+{
+	ThreadPool(int);
+	~ThreadPool();
+	
+	int size() const;
+	
+	// Calls job(i, context) once for every i in [0, count), spread across the pool, and returns
+	// when all of the calls have finished. Jobs may run in any order.
+	void run(int count, void (*job)(int, void*), void* context);
+	
+private:
+	struct Batch
+	{
+		void (*job)(int, void*);
+		void* context;
+		atomic<int> remaining;
+	};
+	
+	struct Task
+	{
+		Batch* batch;
+		int index;
+	};
+	
+	struct Queue
+	{
+		mutex lock;
+		deque<Task> tasks;
+	};
+	
+	vector<thread> workers;
+	
+	// One queue per worker, plus one shared by threads from outside the pool
+	vector<Queue*> queues;
+	
+	mutex lock;
+	condition_variable changed;
+	atomic<int> pending;
+	bool stopping;
+	
+	void worker_main(int);
+	bool run_one(int);
+	
+	ThreadPool(const ThreadPool&);
+	ThreadPool& operator=(const ThreadPool&);
+};
+
+
+
+#endif